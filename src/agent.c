@@ -0,0 +1,357 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+// conditions are tiny, gdb itself uses the same limits for its stub
+#define DG_AGENT_STACK_SIZE 100
+#define DG_AGENT_MAX_STEPS 10000
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "agent.h"
+
+// gdb agent expressions are bytecode for a stack machine of 64 bit values,
+// described in the "Agent Expressions" appendix of the gdb manual. only
+// what breakpoint conditions need is implemented: no floats, no trace
+// state variables and no printf. trace bytecodes are accepted, and do
+// nothing besides their stack effects.
+
+typedef enum {
+    OP_ADD = 0x02,
+    OP_SUB = 0x03,
+    OP_MUL = 0x04,
+    OP_DIV_SIGNED = 0x05,
+    OP_DIV_UNSIGNED = 0x06,
+    OP_REM_SIGNED = 0x07,
+    OP_REM_UNSIGNED = 0x08,
+    OP_LSH = 0x09,
+    OP_RSH_SIGNED = 0x0a,
+    OP_RSH_UNSIGNED = 0x0b,
+    OP_TRACE = 0x0c,
+    OP_TRACE_QUICK = 0x0d,
+    OP_LOG_NOT = 0x0e,
+    OP_BIT_AND = 0x0f,
+    OP_BIT_OR = 0x10,
+    OP_BIT_XOR = 0x11,
+    OP_BIT_NOT = 0x12,
+    OP_EQUAL = 0x13,
+    OP_LESS_SIGNED = 0x14,
+    OP_LESS_UNSIGNED = 0x15,
+    OP_EXT = 0x16,
+    OP_REF8 = 0x17,
+    OP_REF16 = 0x18,
+    OP_REF32 = 0x19,
+    OP_REF64 = 0x1a,
+    OP_IF_GOTO = 0x20,
+    OP_GOTO = 0x21,
+    OP_CONST8 = 0x22,
+    OP_CONST16 = 0x23,
+    OP_CONST32 = 0x24,
+    OP_CONST64 = 0x25,
+    OP_REG = 0x26,
+    OP_END = 0x27,
+    OP_DUP = 0x28,
+    OP_POP = 0x29,
+    OP_ZERO_EXT = 0x2a,
+    OP_SWAP = 0x2b,
+    OP_TRACEV = 0x2e,
+    OP_TRACENZ = 0x2f,
+    OP_TRACE16 = 0x30,
+    OP_PICK = 0x32,
+    OP_ROT = 0x33,
+} opcode_t;
+
+
+static uint64_t
+sign_extend(uint64_t v, uint8_t bits)
+{
+    if (bits == 0 || bits >= 64)
+        return v;
+    uint64_t m = ((uint64_t) 1) << (bits - 1);
+    v &= (((uint64_t) 1) << bits) - 1;
+    return (v ^ m) - m;
+}
+
+
+static uint64_t
+zero_extend(uint64_t v, uint8_t bits)
+{
+    if (bits >= 64)
+        return v;
+    return v & ((((uint64_t) 1) << bits) - 1);
+}
+
+
+bool
+dg_agent_eval(const uint8_t *expr, size_t expr_len,
+    const dg_agent_target_t *target, int64_t *result, dg_error_t **err)
+{
+    if (expr == NULL || target == NULL || result == NULL || err == NULL ||
+        *err != NULL)
+        return false;
+
+    uint64_t stack[DG_AGENT_STACK_SIZE];
+    size_t sp = 0;
+    size_t pc = 0;
+
+    for (size_t steps = 0; steps < DG_AGENT_MAX_STEPS; steps++) {
+        if (pc >= expr_len) {
+            *err = dg_error_new_printf(DG_ERROR_AGENT,
+                "Expression ended without an end bytecode");
+            return false;
+        }
+
+        uint8_t op = expr[pc];
+
+        // operands are big endian, and follow the opcode
+        size_t operand_len = 0;
+        switch (op) {
+            case OP_TRACE_QUICK:
+            case OP_EXT:
+            case OP_CONST8:
+            case OP_ZERO_EXT:
+            case OP_PICK:
+                operand_len = 1;
+                break;
+            case OP_IF_GOTO:
+            case OP_GOTO:
+            case OP_CONST16:
+            case OP_REG:
+            case OP_TRACEV:
+            case OP_TRACE16:
+                operand_len = 2;
+                break;
+            case OP_CONST32:
+                operand_len = 4;
+                break;
+            case OP_CONST64:
+                operand_len = 8;
+                break;
+        }
+        if (pc + 1 + operand_len > expr_len) {
+            *err = dg_error_new_printf(DG_ERROR_AGENT,
+                "Truncated bytecode 0x%02x at offset %zu", op, pc);
+            return false;
+        }
+        uint64_t operand = 0;
+        for (size_t i = 0; i < operand_len; i++)
+            operand = (operand << 8) | expr[pc + 1 + i];
+
+        // stack effects: how many values are popped, and how many pushed
+        size_t pops = 0;
+        size_t pushes = 0;
+        switch (op) {
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV_SIGNED:
+            case OP_DIV_UNSIGNED: case OP_REM_SIGNED: case OP_REM_UNSIGNED:
+            case OP_LSH: case OP_RSH_SIGNED: case OP_RSH_UNSIGNED:
+            case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR: case OP_EQUAL:
+            case OP_LESS_SIGNED: case OP_LESS_UNSIGNED:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_LOG_NOT: case OP_BIT_NOT: case OP_EXT: case OP_ZERO_EXT:
+            case OP_REF8: case OP_REF16: case OP_REF32: case OP_REF64:
+            case OP_TRACE_QUICK: case OP_TRACE16:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OP_TRACE: case OP_TRACENZ: case OP_SWAP:
+                pops = 2;
+                pushes = op == OP_SWAP ? 2 : 0;
+                break;
+            case OP_IF_GOTO: case OP_POP: case OP_END:
+                pops = 1;
+                break;
+            case OP_CONST8: case OP_CONST16: case OP_CONST32: case OP_CONST64:
+            case OP_REG:
+                pushes = 1;
+                break;
+            case OP_DUP:
+                pops = 1;
+                pushes = 2;
+                break;
+            case OP_PICK:
+                pops = operand + 1;
+                pushes = operand + 2;
+                break;
+            case OP_ROT:
+                pops = 3;
+                pushes = 3;
+                break;
+            case OP_GOTO: case OP_TRACEV:
+                break;
+            default:
+                *err = dg_error_new_printf(DG_ERROR_AGENT,
+                    "Unsupported bytecode 0x%02x at offset %zu", op, pc);
+                return false;
+        }
+        if (sp < pops) {
+            *err = dg_error_new_printf(DG_ERROR_AGENT,
+                "Stack underflow at offset %zu", pc);
+            return false;
+        }
+        if (sp - pops + pushes > DG_AGENT_STACK_SIZE) {
+            *err = dg_error_new_printf(DG_ERROR_AGENT,
+                "Stack overflow at offset %zu", pc);
+            return false;
+        }
+
+        size_t next = pc + 1 + operand_len;
+        uint64_t a = sp >= 2 ? stack[sp - 2] : 0;
+        uint64_t b = sp >= 1 ? stack[sp - 1] : 0;
+
+        switch (op) {
+            case OP_ADD:
+                stack[sp - 2] = a + b;
+                break;
+            case OP_SUB:
+                stack[sp - 2] = a - b;
+                break;
+            case OP_MUL:
+                stack[sp - 2] = a * b;
+                break;
+            case OP_DIV_SIGNED:
+            case OP_DIV_UNSIGNED:
+            case OP_REM_SIGNED:
+            case OP_REM_UNSIGNED:
+                if (b == 0) {
+                    *err = dg_error_new_printf(DG_ERROR_AGENT,
+                        "Division by zero at offset %zu", pc);
+                    return false;
+                }
+                if (op == OP_DIV_UNSIGNED)
+                    stack[sp - 2] = a / b;
+                else if (op == OP_REM_UNSIGNED)
+                    stack[sp - 2] = a % b;
+                else if ((int64_t) b == -1)  // INT64_MIN / -1 overflows
+                    stack[sp - 2] = op == OP_DIV_SIGNED ? -a : 0;
+                else if (op == OP_DIV_SIGNED)
+                    stack[sp - 2] = (int64_t) a / (int64_t) b;
+                else
+                    stack[sp - 2] = (int64_t) a % (int64_t) b;
+                break;
+            case OP_LSH:
+                stack[sp - 2] = b >= 64 ? 0 : a << b;
+                break;
+            case OP_RSH_SIGNED:
+                if (b >= 64)
+                    b = 63;
+                stack[sp - 2] = (a >> b) | ((a >> 63) && b > 0 ? ~(UINT64_MAX >> b) : 0);
+                break;
+            case OP_RSH_UNSIGNED:
+                stack[sp - 2] = b >= 64 ? 0 : a >> b;
+                break;
+            case OP_LOG_NOT:
+                stack[sp - 1] = b == 0;
+                break;
+            case OP_BIT_AND:
+                stack[sp - 2] = a & b;
+                break;
+            case OP_BIT_OR:
+                stack[sp - 2] = a | b;
+                break;
+            case OP_BIT_XOR:
+                stack[sp - 2] = a ^ b;
+                break;
+            case OP_BIT_NOT:
+                stack[sp - 1] = ~b;
+                break;
+            case OP_EQUAL:
+                stack[sp - 2] = a == b;
+                break;
+            case OP_LESS_SIGNED:
+                stack[sp - 2] = (int64_t) a < (int64_t) b;
+                break;
+            case OP_LESS_UNSIGNED:
+                stack[sp - 2] = a < b;
+                break;
+            case OP_EXT:
+                stack[sp - 1] = sign_extend(b, operand);
+                break;
+            case OP_ZERO_EXT:
+                stack[sp - 1] = zero_extend(b, operand);
+                break;
+            case OP_REF8:
+            case OP_REF16:
+            case OP_REF32:
+            case OP_REF64:
+                {
+                    // avr is little endian
+                    uint8_t len = 1 << (op - OP_REF8);
+                    uint8_t v[8];
+                    if (target->read_memory == NULL ||
+                        !target->read_memory(target->data, b, v, len, err)) {
+                        if (*err == NULL)
+                            *err = dg_error_new_printf(DG_ERROR_AGENT,
+                                "Failed to read memory: 0x%08x", (uint32_t) b);
+                        return false;
+                    }
+                    uint64_t val = 0;
+                    for (uint8_t i = len; i > 0; i--)
+                        val = (val << 8) | v[i - 1];
+                    stack[sp - 1] = val;
+                }
+                break;
+            case OP_IF_GOTO:
+                if (b != 0)
+                    next = operand;
+                break;
+            case OP_GOTO:
+                next = operand;
+                break;
+            case OP_CONST8:
+            case OP_CONST16:
+            case OP_CONST32:
+            case OP_CONST64:
+                stack[sp] = operand;
+                break;
+            case OP_REG:
+                if (target->read_register == NULL ||
+                    !target->read_register(target->data, operand, &stack[sp], err)) {
+                    if (*err == NULL)
+                        *err = dg_error_new_printf(DG_ERROR_AGENT,
+                            "Failed to read register: %u", (unsigned) operand);
+                    return false;
+                }
+                break;
+            case OP_END:
+                *result = b;
+                return true;
+            case OP_DUP:
+                stack[sp] = b;
+                break;
+            case OP_SWAP:
+                stack[sp - 2] = b;
+                stack[sp - 1] = a;
+                break;
+            case OP_PICK:
+                stack[sp] = stack[sp - 1 - operand];
+                break;
+            case OP_ROT:
+                // a b c => c a b
+                stack[sp - 1] = a;
+                stack[sp - 2] = stack[sp - 3];
+                stack[sp - 3] = b;
+                break;
+        }
+
+        sp = sp - pops + pushes;
+        pc = next;
+    }
+
+    *err = dg_error_new_printf(DG_ERROR_AGENT,
+        "Expression did not end after %d bytecodes", DG_AGENT_MAX_STEPS);
+    return false;
+}
@@ -0,0 +1,31 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+// register numbers and addresses are the ones gdb uses.
+typedef bool (*dg_agent_read_register_func_t) (void *data, uint16_t reg,
+    uint64_t *value, dg_error_t **err);
+typedef bool (*dg_agent_read_memory_func_t) (void *data, uint32_t address,
+    uint8_t *values, uint16_t values_len, dg_error_t **err);
+
+typedef struct {
+    dg_agent_read_register_func_t read_register;
+    dg_agent_read_memory_func_t read_memory;
+    void *data;
+} dg_agent_target_t;
+
+bool dg_agent_eval(const uint8_t *expr, size_t expr_len,
+    const dg_agent_target_t *target, int64_t *result, dg_error_t **err);
@@ -0,0 +1,405 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+// we don't need to remember every adapter ever plugged
+#define DG_CACHE_MAX_ENTRIES 32
+
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "debug.h"
+#include "utils.h"
+#include "cache.h"
+
+// the cache file has one line per adapter, most recently used first:
+//
+//     <adapter id> <baud rate> <target signature>
+//
+// the adapter id is its /dev/serial/by-id path, when available, because
+// /dev/ttyUSB* numbers change depending on the order adapters are plugged.
+//
+// breakpoints left in flash are recorded in another file, one per line:
+//
+//     <adapter id> <target signature> <word address> <original opcode>
+
+typedef struct {
+    char *id;
+    uint32_t baudrate;
+    uint16_t signature;
+} dg_cache_entry_t;
+
+static bool cache = true;
+
+
+void
+dg_cache_set(bool c)
+{
+    cache = c;
+}
+
+
+static char*
+get_filename(const char *name)
+{
+    const char *dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL && dir[0] != '\0')
+        return dg_strdup_printf("%s/%s/%s", dir, PACKAGE_NAME, name);
+
+    const char *home = getenv("HOME");
+    if (home != NULL && home[0] != '\0')
+        return dg_strdup_printf("%s/.cache/%s/%s", home, PACKAGE_NAME, name);
+
+    return NULL;
+}
+
+
+static bool
+mkdir_parents(const char *filename)
+{
+    char *tmp = dg_strdup(filename);
+    for (char *c = tmp + 1; *c != '\0'; c++) {
+        if (*c != '/')
+            continue;
+        *c = '\0';
+        if (0 != mkdir(tmp, 0755) && errno != EEXIST) {
+            free(tmp);
+            return false;
+        }
+        *c = '/';
+    }
+    free(tmp);
+    return true;
+}
+
+
+static void
+free_entries(dg_cache_entry_t *entries, size_t entries_len)
+{
+    if (entries == NULL)
+        return;
+    for (size_t i = 0; i < entries_len; i++)
+        free(entries[i].id);
+    free(entries);
+}
+
+
+static dg_cache_entry_t*
+load_entries(size_t *entries_len)
+{
+    *entries_len = 0;
+
+    if (!cache)
+        return NULL;
+
+    char *filename = get_filename("sessions");
+    if (filename == NULL)
+        return NULL;
+
+    FILE *fp = fopen(filename, "r");
+    free(filename);
+    if (fp == NULL)
+        return NULL;
+
+    dg_cache_entry_t *rv = NULL;
+    char line[PATH_MAX + 32];
+
+    while (*entries_len < DG_CACHE_MAX_ENTRIES && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char **pieces = dg_str_split(line, ' ', 0);
+        if (3 != dg_strv_length(pieces)) {
+            dg_strv_free(pieces);
+            continue;
+        }
+
+        rv = dg_realloc(rv, sizeof(dg_cache_entry_t) * (*entries_len + 1));
+        rv[*entries_len].id = dg_strdup(pieces[0]);
+        rv[*entries_len].baudrate = strtoul(pieces[1], NULL, 10);
+        rv[*entries_len].signature = strtoul(pieces[2], NULL, 16);
+        (*entries_len)++;
+
+        dg_strv_free(pieces);
+    }
+
+    fclose(fp);
+
+    return rv;
+}
+
+
+static bool
+same_file(const char *a, const char *b)
+{
+    char *ra = realpath(a, NULL);
+    if (ra == NULL)
+        return false;
+
+    char *rb = realpath(b, NULL);
+    if (rb == NULL) {
+        free(ra);
+        return false;
+    }
+
+    bool rv = 0 == strcmp(ra, rb);
+
+    free(ra);
+    free(rb);
+
+    return rv;
+}
+
+
+char*
+dg_cache_get_port_id(const char *port)
+{
+    if (port == NULL)
+        return NULL;
+
+    glob_t globbuf;
+    if (0 == glob("/dev/serial/by-id/*", 0, NULL, &globbuf)) {
+        for (size_t i = 0; i < globbuf.gl_pathc; i++) {
+            if (same_file(port, globbuf.gl_pathv[i])) {
+                char *rv = dg_strdup(globbuf.gl_pathv[i]);
+                globfree(&globbuf);
+                return rv;
+            }
+        }
+    }
+    globfree(&globbuf);
+
+    char *rv = realpath(port, NULL);
+    if (rv == NULL)
+        return dg_strdup(port);
+
+    return rv;
+}
+
+
+char*
+dg_cache_lookup_port(char **ports, size_t ports_len)
+{
+    if (ports == NULL)
+        return NULL;
+
+    size_t entries_len;
+    dg_cache_entry_t *entries = load_entries(&entries_len);
+
+    for (size_t i = 0; i < entries_len; i++) {
+        for (size_t j = 0; j < ports_len; j++) {
+            if (same_file(entries[i].id, ports[j])) {
+                char *rv = dg_strdup(ports[j]);
+                free_entries(entries, entries_len);
+                return rv;
+            }
+        }
+    }
+
+    free_entries(entries, entries_len);
+
+    return NULL;
+}
+
+
+bool
+dg_cache_lookup(const char *id, uint32_t *baudrate, uint16_t *signature)
+{
+    if (id == NULL)
+        return false;
+
+    size_t entries_len;
+    dg_cache_entry_t *entries = load_entries(&entries_len);
+
+    bool rv = false;
+
+    for (size_t i = 0; i < entries_len; i++) {
+        if (0 == strcmp(entries[i].id, id) && entries[i].baudrate != 0) {
+            if (baudrate != NULL)
+                *baudrate = entries[i].baudrate;
+            if (signature != NULL)
+                *signature = entries[i].signature;
+            rv = true;
+            break;
+        }
+    }
+
+    free_entries(entries, entries_len);
+
+    return rv;
+}
+
+
+bool
+dg_cache_store(const char *id, uint32_t baudrate, uint16_t signature)
+{
+    if (!cache || id == NULL || baudrate == 0)
+        return false;
+
+    char *filename = get_filename("sessions");
+    if (filename == NULL)
+        return false;
+
+    if (!mkdir_parents(filename)) {
+        dg_debug_printf(" * Failed to create session cache directory\n");
+        free(filename);
+        return false;
+    }
+
+    size_t entries_len;
+    dg_cache_entry_t *entries = load_entries(&entries_len);
+
+    char *tmp = dg_strdup_printf("%s.tmp", filename);
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        dg_debug_printf(" * Failed to write session cache: %s\n", tmp);
+        free_entries(entries, entries_len);
+        free(filename);
+        free(tmp);
+        return false;
+    }
+
+    fprintf(fp, "%s %u %04x\n", id, baudrate, signature);
+
+    size_t count = 1;
+    for (size_t i = 0; i < entries_len && count < DG_CACHE_MAX_ENTRIES; i++) {
+        if (0 == strcmp(entries[i].id, id))
+            continue;
+        fprintf(fp, "%s %u %04x\n", entries[i].id, entries[i].baudrate,
+            entries[i].signature);
+        count++;
+    }
+
+    free_entries(entries, entries_len);
+
+    bool rv = 0 == fclose(fp) && 0 == rename(tmp, filename);
+    if (!rv) {
+        dg_debug_printf(" * Failed to write session cache: %s\n", filename);
+        remove(tmp);
+    }
+
+    free(filename);
+    free(tmp);
+
+    return rv;
+}
+
+
+dg_cache_breakpoint_t*
+dg_cache_lookup_breakpoints(const char *id, uint16_t signature, size_t *len)
+{
+    if (len == NULL)
+        return NULL;
+    *len = 0;
+
+    if (!cache || id == NULL)
+        return NULL;
+
+    char *filename = get_filename("breakpoints");
+    if (filename == NULL)
+        return NULL;
+
+    FILE *fp = fopen(filename, "r");
+    free(filename);
+    if (fp == NULL)
+        return NULL;
+
+    dg_cache_breakpoint_t *rv = NULL;
+    char line[PATH_MAX + 32];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char **pieces = dg_str_split(line, ' ', 0);
+        if (4 != dg_strv_length(pieces) || 0 != strcmp(pieces[0], id) ||
+            signature != strtoul(pieces[1], NULL, 16)) {
+            dg_strv_free(pieces);
+            continue;
+        }
+
+        rv = dg_realloc(rv, sizeof(dg_cache_breakpoint_t) * (*len + 1));
+        rv[*len].address = strtoul(pieces[2], NULL, 16);
+        rv[*len].original = strtoul(pieces[3], NULL, 16);
+        (*len)++;
+
+        dg_strv_free(pieces);
+    }
+
+    fclose(fp);
+
+    return rv;
+}
+
+
+bool
+dg_cache_store_breakpoints(const char *id, uint16_t signature,
+    const dg_cache_breakpoint_t *bps, size_t len)
+{
+    if (!cache || id == NULL)
+        return false;
+
+    char *filename = get_filename("breakpoints");
+    if (filename == NULL)
+        return false;
+
+    if (!mkdir_parents(filename)) {
+        dg_debug_printf(" * Failed to create session cache directory\n");
+        free(filename);
+        return false;
+    }
+
+    char *tmp = dg_strdup_printf("%s.tmp", filename);
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        dg_debug_printf(" * Failed to write breakpoint cache: %s\n", tmp);
+        free(filename);
+        free(tmp);
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        fprintf(fp, "%s %04x %04x %04x\n", id, signature, bps[i].address,
+            bps[i].original);
+
+    // whatever other adapters left behind is kept
+    FILE *old = fopen(filename, "r");
+    if (old != NULL) {
+        char line[PATH_MAX + 32];
+        while (fgets(line, sizeof(line), old) != NULL) {
+            size_t l = strlen(id);
+            if (0 == strncmp(line, id, l) && line[l] == ' ')
+                continue;
+            fputs(line, fp);
+        }
+        fclose(old);
+    }
+
+    bool rv = 0 == fclose(fp) && 0 == rename(tmp, filename);
+    if (!rv) {
+        dg_debug_printf(" * Failed to write breakpoint cache: %s\n", filename);
+        remove(tmp);
+    }
+
+    free(filename);
+    free(tmp);
+
+    return rv;
+}
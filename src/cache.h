@@ -0,0 +1,29 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint16_t address;
+    uint16_t original;
+} dg_cache_breakpoint_t;
+
+void dg_cache_set(bool c);
+char* dg_cache_get_port_id(const char *port);
+char* dg_cache_lookup_port(char **ports, size_t ports_len);
+bool dg_cache_lookup(const char *id, uint32_t *baudrate, uint16_t *signature);
+bool dg_cache_store(const char *id, uint32_t baudrate, uint16_t signature);
+dg_cache_breakpoint_t* dg_cache_lookup_breakpoints(const char *id,
+    uint16_t signature, size_t *len);
+bool dg_cache_store_breakpoints(const char *id, uint16_t signature,
+    const dg_cache_breakpoint_t *bps, size_t len);
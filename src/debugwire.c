@@ -15,23 +15,65 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "error.h"
 #include "serial.h"
 #include "utils.h"
 #include "debugwire.h"
 
+// the target must go through its startup delay before answering a reset
+#define DG_DEBUGWIRE_RESET_TIMEOUT 500
+
+// page erase and page write take about 4.5ms each
+#define DG_DEBUGWIRE_SPM_TIMEOUT 100
+
+// an eeprom write takes about 3.4ms, and each poll is a round trip
+#define DG_DEBUGWIRE_EEPROM_POLL_MAX 100
+
+#define DG_DEBUGWIRE_OPCODE_BREAK 0x9598
+
+// eeprom bytes read per batch, into r0-r27
+#define DG_DEBUGWIRE_EEPROM_CHUNK 28
+
+// memory frames carry the length doubled, in 16 bits
+#define DG_DEBUGWIRE_MEMORY_CHUNK 0x1000
+
+#define DG_DEBUGWIRE_CONTEXT_BIT(b) (((uint64_t) 1) << (b))
+
+// debugWIRE runs at cpu frequency / 128. max supported cpu freq is 20mhz.
+// there are faster avrs, but their usually have PDI
+#define DG_DEBUGWIRE_BAUDRATE_MIN (1000000 / 128)
+#define DG_DEBUGWIRE_BAUDRATE_MAX (20000000 / 128)
+
+// in percent. a 0x55 is still decoded with a baud rate mismatch of about 4%,
+// so sweeping with smaller steps can't miss a target clock
+#define DG_DEBUGWIRE_BAUDRATE_SWEEP_STEP 3
+#define DG_DEBUGWIRE_BAUDRATE_REFINE_STEP 2
+#define DG_DEBUGWIRE_BAUDRATE_REFINE_MAX 5
+
 // FIXME: I'm only listing here the devices I own.
 static const dg_debugwire_device_t devices[] = {
-    {"ATtiny84", 0x930c},
-    {"ATtiny85", 0x930b},
-    {NULL, 0},
+    {"ATtiny84", 0x930c, 8192, 64, 512},
+    {"ATtiny85", 0x930b, 8192, 64, 512},
+    {NULL, 0, 0, 0, 0},
 };
 
-static uint8_t tmp_reg[4] = {0};
-static uint16_t tmp_pc = 0;
+static bool load_breakpoints(dg_debugwire_t *dw, dg_error_t **err);
+
+// cpu clocks probed before sweeping the whole baud rate range, most common
+// first: internal rc oscillators, common crystals, uart-friendly crystals and
+// then whatever integer mhz clock is left.
+static const uint32_t clocks[] = {
+    1000000, 8000000, 16000000, 20000000, 12000000,
+    7372800, 11059200, 14745600, 18432000, 3686400, 1843200,
+    2000000, 4000000, 6000000, 10000000, 3000000, 5000000, 7000000, 9000000,
+    13000000, 14000000, 15000000, 17000000, 18000000, 19000000, 11000000,
+    0,
+};
 
 
 static const dg_debugwire_device_t*
@@ -78,6 +120,14 @@ guess_port(dg_error_t **err)
         return NULL;
     }
 
+    // pick the adapter used most recently, if any
+    char *cached = dg_cache_lookup_port(globbuf.gl_pathv, globbuf.gl_pathc);
+    if (cached != NULL) {
+        dg_debug_printf(" * Detected serial port (cached): %s\n", cached);
+        globfree(&globbuf);
+        return cached;
+    }
+
     dg_string_t *msg = dg_string_new();
     dg_string_append(msg, "More than one serial port found, please select one: ");
     for (size_t i = 0; i < globbuf.gl_pathc; i++) {
@@ -96,39 +146,160 @@ guess_port(dg_error_t **err)
 }
 
 
+static int
+open_port(const char *device, uint32_t baudrate, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return -1;
+
+    int fd = dg_serial_open(device, baudrate, err);
+    if (fd < 0 || *err != NULL)
+        return -1;
+
+    uint8_t b = dg_serial_send_break(fd, err);
+    if (*err != NULL) {
+        dg_serial_close(fd);
+        return -1;
+    }
+
+    if (b != 0x55) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Bad break response from MCU. Expected 0x55, got 0x%02x", b);
+        dg_serial_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static bool
+probe_baudrate(int fd, uint32_t baudrate, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return false;
+
+    if (!dg_serial_set_baudrate(fd, baudrate, err))
+        return false;
+
+    uint8_t b = dg_serial_send_break(fd, err);
+    if (*err != NULL) {
+        // nothing that could be decoded with this baud rate
+        if ((*err)->type == DG_ERROR_SERIAL_TIMEOUT) {
+            dg_error_free(*err);
+            *err = NULL;
+        }
+        return false;
+    }
+
+    return b == 0x55;
+}
+
+
 static uint32_t
-guess_baudrate(const char *device, dg_error_t **err)
+refine_baudrate(int fd, uint32_t baudrate, dg_error_t **err)
 {
     if (err == NULL || *err != NULL)
         return 0;
 
-    // max supported cpu freq is 20mhz. there are faster avrs, but their usually
-    // have PDI
+    // the clock that answered may be anywhere inside the window of baud rates
+    // that decode the 0x55 correctly (e.g. drifting rc oscillators), walk to
+    // both edges of the window and pick its center.
+    uint32_t hi = baudrate;
+    for (size_t i = 0; i < DG_DEBUGWIRE_BAUDRATE_REFINE_MAX; i++) {
+        uint32_t b = (hi * (100 + DG_DEBUGWIRE_BAUDRATE_REFINE_STEP)) / 100;
+        if (!probe_baudrate(fd, b, err))
+            break;
+        hi = b;
+    }
+    if (*err != NULL)
+        return 0;
+
+    uint32_t lo = baudrate;
+    for (size_t i = 0; i < DG_DEBUGWIRE_BAUDRATE_REFINE_MAX; i++) {
+        uint32_t b = (lo * (100 - DG_DEBUGWIRE_BAUDRATE_REFINE_STEP)) / 100;
+        if (!probe_baudrate(fd, b, err))
+            break;
+        lo = b;
+    }
+    if (*err != NULL)
+        return 0;
 
-    for (size_t i = 20; i > 0; i--) {
-        uint32_t baudrate = (i * 1000000) / 128;
+    uint32_t rv = (lo + hi) / 2;
+    if (probe_baudrate(fd, rv, err))
+        return rv;
+    if (*err != NULL)
+        return 0;
 
-        int fd = dg_serial_open(device, baudrate, err);
-        if (*err != NULL)
-            return 0;
+    // leave the port at a baud rate that is known to work
+    if (!probe_baudrate(fd, baudrate, err))
+        return 0;
 
-        uint8_t b = dg_serial_send_break(fd, err);
-        close(fd);
+    return baudrate;
+}
+
+
+static int
+guess_baudrate(const char *device, uint32_t *baudrate, dg_error_t **err)
+{
+    if (baudrate == NULL || err == NULL || *err != NULL)
+        return -1;
+
+    // the port is opened only once, and the baud rate is changed in place.
+    int fd = dg_serial_open(device, clocks[0] / 128, err);
+    if (fd < 0 || *err != NULL)
+        return -1;
+
+    uint32_t found = 0;
+    bool swept = false;
+
+    for (size_t i = 0; clocks[i] != 0; i++) {
+        if (probe_baudrate(fd, clocks[i] / 128, err)) {
+            found = clocks[i] / 128;
+            break;
+        }
         if (*err != NULL)
-            return 0;
+            goto err;
+    }
 
-        if (b == 0x55) {
-            dg_debug_printf(" * Detected baudrate: %d\n", baudrate);
-            return baudrate;
+    if (found == 0) {
+        swept = true;
+        for (uint32_t b = DG_DEBUGWIRE_BAUDRATE_MAX;
+            b >= DG_DEBUGWIRE_BAUDRATE_MIN * (100 - DG_DEBUGWIRE_BAUDRATE_SWEEP_STEP) / 100;
+            b = (b * (100 - DG_DEBUGWIRE_BAUDRATE_SWEEP_STEP)) / 100)
+        {
+            if (probe_baudrate(fd, b, err)) {
+                found = b;
+                break;
+            }
+            if (*err != NULL)
+                goto err;
         }
+    }
+
+    if (found == 0) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Failed to detect baudrate for serial port (%s)", device);
+        goto err;
+    }
 
-        usleep(10000);
+    // a common clock that answers is taken as is, and the port is already
+    // right after its good break. only a rate found by the sweep is refined,
+    // as it may sit at the edge of the window that decodes the 0x55.
+    *baudrate = found;
+    if (swept) {
+        *baudrate = refine_baudrate(fd, found, err);
+        if (*baudrate == 0 || *err != NULL)
+            goto err;
     }
 
-    *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
-        "Failed to detect baudrate for serial port (%s)", device);
+    dg_debug_printf(" * Detected baudrate: %d\n", *baudrate);
+
+    return fd;
 
-    return 0;
+err:
+    dg_serial_close(fd);
+    return -1;
 }
 
 
@@ -148,46 +319,115 @@ dg_debugwire_new(const char *device, uint32_t baudrate, dg_error_t **err)
         dev = dg_strdup(device);
     }
 
-    if (baudrate == 0) {
-        baudrate = guess_baudrate(dev, err);
-        if (baudrate == 0 || *err != NULL) {
-            free(dev);
-            return NULL;
+    char *id = dg_cache_get_port_id(dev);
+    uint32_t cached_baudrate = 0;
+    uint16_t cached_signature = 0;
+    bool cached = false;
+
+    int fd = -1;
+
+    if (baudrate == 0 && dg_cache_lookup(id, &cached_baudrate, &cached_signature)) {
+        fd = open_port(dev, cached_baudrate, err);
+        if (fd >= 0 && *err == NULL) {
+            // a good break may still come from another target running with
+            // the same clock, the signature tells them apart
+            dg_debugwire_t tmp = {.fd = fd};
+            uint16_t sign = dg_debugwire_get_signature(&tmp, err);
+            if (*err == NULL && sign == cached_signature) {
+                dg_debug_printf(" * Detected baudrate (cached): %d\n", cached_baudrate);
+                baudrate = cached_baudrate;
+                cached = true;
+            }
+            else {
+                if (*err == NULL)
+                    dg_debug_printf(" * Cached signature mismatch: 0x%04x\n", sign);
+                dg_serial_close(fd);
+                fd = -1;
+            }
+        }
+        if (!cached) {
+            // whatever happened, full detection will tell us
+            dg_error_free(*err);
+            *err = NULL;
         }
     }
 
-    int fd = dg_serial_open(dev, baudrate, err);
-    if (fd < 0 || *err != NULL) {
-        free(dev);
-        return NULL;
+    if (fd < 0 && baudrate == 0) {
+        // autodetection leaves the port open, right after a good break
+        fd = guess_baudrate(dev, &baudrate, err);
+    }
+    else if (fd < 0) {
+        fd = open_port(dev, baudrate, err);
     }
 
-    uint8_t b = dg_serial_send_break(fd, err);
-    if (*err != NULL) {
+    if (fd < 0 || *err != NULL) {
         free(dev);
-        close(fd);
+        free(id);
         return NULL;
     }
 
-    if (b != 0x55) {
-        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
-            "Bad break response from MCU. Expected 0x55, got 0x%02x", b);
-        return false;
-    }
-
     dg_debugwire_t *rv = dg_malloc(sizeof(dg_debugwire_t));
     rv->device = dev;
     rv->baudrate = baudrate;
     rv->fd = fd;
-    rv->dev = guess_device(rv, err);
-    if (rv->dev == NULL || *err != NULL) {
-        dg_debugwire_free(rv);
-        return NULL;
+    rv->dev = NULL;
+    rv->flash_cache = NULL;
+    rv->flash_cache_valid = NULL;
+    rv->flash_staging = NULL;
+    rv->flash_staging_dirty = NULL;
+    rv->id = NULL;
+    rv->breakpoints = NULL;
+    rv->breakpoints_len = 0;
+    rv->context.valid = 0;
+    rv->context.dirty = 0;
+
+    // the signature read right after the break matched the cached one
+    if (cached) {
+        for (size_t i = 0; devices[i].name != NULL; i++) {
+            if (cached_signature == devices[i].signature) {
+                dg_debug_printf(" * Detected device (cached): %s\n", devices[i].name);
+                rv->dev = &devices[i];
+                break;
+            }
+        }
+    }
+
+    if (rv->dev == NULL) {
+        rv->dev = guess_device(rv, err);
+        if (rv->dev == NULL || *err != NULL) {
+            free(id);
+            dg_debugwire_free(rv);
+            return NULL;
+        }
     }
+
+    // stored even on a cache hit, so the entry moves to the top, and the port
+    // guessed next time is the one used last
+    dg_cache_store(id, baudrate, rv->dev->signature);
+    rv->id = id;
+
     rv->timer = false;
     rv->hw_breakpoint_set = false;
     rv->hw_breakpoint = 0;
 
+    // flash can't change behind our back, unless we write it
+    rv->flash_cache = dg_malloc(rv->dev->flash_size);
+    size_t pages = rv->dev->flash_size / rv->dev->flash_page_size;
+    rv->flash_cache_valid = dg_malloc(sizeof(bool) * pages);
+    for (size_t i = 0; i < pages; i++)
+        rv->flash_cache_valid[i] = false;
+
+    // pages written by gdb are staged, and only programmed if changed
+    rv->flash_staging = dg_malloc(rv->dev->flash_size);
+    rv->flash_staging_dirty = dg_malloc(sizeof(bool) * pages);
+    for (size_t i = 0; i < pages; i++)
+        rv->flash_staging_dirty[i] = false;
+
+    if (!load_breakpoints(rv, err)) {
+        dg_debugwire_free(rv);
+        return NULL;
+    }
+
     return rv;
 }
 
@@ -199,7 +439,13 @@ dg_debugwire_free(dg_debugwire_t *dw)
         return;
 
     free(dw->device);
-    close(dw->fd);
+    free(dw->flash_cache);
+    free(dw->flash_cache_valid);
+    free(dw->flash_staging);
+    free(dw->flash_staging_dirty);
+    free(dw->breakpoints);
+    free(dw->id);
+    dg_serial_close(dw->fd);
     free(dw);
 }
 
@@ -210,7 +456,8 @@ dg_debugwire_get_signature(dg_debugwire_t *dw, dg_error_t **err)
     if (dw == NULL || err == NULL || *err != NULL)
         return 0;
 
-    if (!dg_serial_write_byte(dw->fd, 0xf3, err))
+    const uint8_t b = 0xf3;
+    if (!dg_serial_queue(dw->fd, &b, 1, err))
         return 0;
 
     uint16_t rv = dg_serial_read_word(dw->fd, err);
@@ -231,7 +478,7 @@ dg_debugwire_set_pc(dg_debugwire_t *dw, uint16_t pc, dg_error_t **err)
         0xd0,
         pc >> 8, pc,
     };
-    return 3 == dg_serial_write(dw->fd, b, 3, err) && *err == NULL;
+    return dg_serial_queue(dw->fd, b, 3, err) && *err == NULL;
 }
 
 
@@ -241,26 +488,157 @@ dg_debugwire_get_pc(dg_debugwire_t *dw, dg_error_t **err)
     if (dw == NULL || err == NULL || *err != NULL)
         return 0;
 
-    if (!dg_serial_write_byte(dw->fd, 0xf0, err))
+    const uint8_t b = 0xf0;
+    if (!dg_serial_queue(dw->fd, &b, 1, err))
         return 0;
 
     uint16_t rv = dg_serial_read_word(dw->fd, err);
     if (*err != NULL)
         return 0;
 
+    // the pc is one word ahead after any halt. for a break instruction this
+    // gives its own address, where gdb expects to see the breakpoint
     if (rv > 0)
-        rv -= 1;  // is this *always* called after break?
+        rv -= 1;
 
     return rv;
 }
 
 
+// the context is read from the target once per halt, and every register
+// (or the pc) clobbered by the debugger is marked dirty, to be written back
+// just before the mcu runs again.
+
+static void
+invalidate_context(dg_debugwire_t *dw)
+{
+    dw->context.valid = 0;
+    dw->context.dirty = 0;
+}
+
+
+static bool
+load_pc(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw->context.valid & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_PC))
+        return true;
+
+    dw->context.pc = dg_debugwire_get_pc(dw, err);
+    if (*err != NULL)
+        return false;
+
+    dg_debug_printf("PC = 0x%02x\n", dw->context.pc);
+
+    // any further command touches the pc, it must always be written back
+    dw->context.valid |= DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_PC);
+    dw->context.dirty |= DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_PC);
+    return true;
+}
+
+
+static bool
+load_registers(dg_debugwire_t *dw, uint8_t start, uint8_t len, dg_error_t **err)
+{
+    if (!load_pc(dw, err))
+        return false;
+
+    uint8_t first = 32;
+    uint8_t last = 0;
+    for (uint8_t i = start; i < start + len; i++) {
+        if (dw->context.valid & DG_DEBUGWIRE_CONTEXT_BIT(i))
+            continue;
+        if (first == 32)
+            first = i;
+        last = i;
+    }
+    if (first == 32)
+        return true;
+
+    // registers already clobbered in between hold garbage, skip them
+    uint8_t buf[32];
+    if (!dg_debugwire_read_registers(dw, first, buf, last - first + 1, err))
+        return false;
+
+    for (uint8_t i = first; i <= last; i++) {
+        if (dw->context.valid & DG_DEBUGWIRE_CONTEXT_BIT(i))
+            continue;
+        dw->context.registers[i] = buf[i - first];
+        dw->context.valid |= DG_DEBUGWIRE_CONTEXT_BIT(i);
+        dg_debug_printf("R%d = 0x%02x\n", i, dw->context.registers[i]);
+    }
+
+    return true;
+}
+
+
+static bool
+clobber_registers(dg_debugwire_t *dw, uint8_t start, uint8_t len, dg_error_t **err)
+{
+    if (!load_registers(dw, start, len, err))
+        return false;
+
+    for (uint8_t i = start; i < start + len; i++)
+        dw->context.dirty |= DG_DEBUGWIRE_CONTEXT_BIT(i);
+
+    return true;
+}
+
+
+static bool
+restore_context(dg_debugwire_t *dw, dg_error_t **err)
+{
+    // these are written through sram, that clobbers z. registers go next
+    if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SP)) {
+        const uint8_t b[2] = {
+            dw->context.sp, dw->context.sp >> 8,
+        };
+        if (!dg_debugwire_write_sram(dw, 0x5d, b, 2, err))
+            return false;
+    }
+    if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SREG)) {
+        if (!dg_debugwire_write_sram(dw, 0x5f, &dw->context.sreg, 1, err))
+            return false;
+    }
+
+    for (uint8_t i = 0; i < 32; i++) {
+        if (!(dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(i)))
+            continue;
+
+        uint8_t j = i;
+        while (j + 1 < 32 && (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(j + 1)))
+            j++;
+
+        if (!dg_debugwire_write_registers(dw, i, dw->context.registers + i,
+                j - i + 1, err))
+            return false;
+
+        i = j;
+    }
+
+    // writing registers touches the pc, it goes last
+    if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_PC)) {
+        if (!dg_debugwire_set_pc(dw, dw->context.pc, err))
+            return false;
+    }
+
+    invalidate_context(dw);
+    return true;
+}
+
+
 bool
 dg_debugwire_disable(dg_debugwire_t *dw, dg_error_t **err)
 {
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
+    // the program must run without our breaks
+    if (!dg_debugwire_clear_breakpoints(dw, err))
+        return false;
+
+    if (!restore_context(dw, err))
+        return false;
+
     return dg_serial_write_byte(dw->fd, 0x06, err);
 }
 
@@ -277,7 +655,16 @@ dg_debugwire_reset(dg_debugwire_t *dw, dg_error_t **err)
     if (!dg_serial_write_byte(dw->fd, 0x07, err))
         return false;
 
-    uint8_t b = dg_serial_recv_break(dw->fd, err);
+    size_t pages = dw->dev->flash_size / dw->dev->flash_page_size;
+    for (size_t i = 0; i < pages; i++)
+        dw->flash_cache_valid[i] = false;
+
+    // nothing to restore, the mcu starts from scratch
+    invalidate_context(dw);
+
+    uint8_t b = dg_serial_recv_break(dw->fd, DG_DEBUGWIRE_RESET_TIMEOUT, err);
+    if (*err != NULL)
+        return false;
 
     if (b != 0x55) {
         *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
@@ -303,10 +690,10 @@ dg_debugwire_write_registers(dg_debugwire_t *dw, uint8_t start,
         0xd1, 0x00, start + values_len,
         0x20,
     };
-    if (10 != dg_serial_write(dw->fd, b, 10, err) || *err != NULL)
+    if (!dg_serial_queue(dw->fd, b, 10, err) || *err != NULL)
         return false;
 
-    return values_len == dg_serial_write(dw->fd, values, values_len, err) && *err == NULL;
+    return dg_serial_queue(dw->fd, values, values_len, err) && *err == NULL;
 }
 
 
@@ -324,7 +711,7 @@ dg_debugwire_read_registers(dg_debugwire_t *dw, uint8_t start,
         0xd1, 0x00, start + values_len,
         0x20,
     };
-    if (10 != dg_serial_write(dw->fd, b, 10, err) || *err != NULL)
+    if (!dg_serial_queue(dw->fd, b, 10, err) || *err != NULL)
         return false;
 
     return values_len == dg_serial_read(dw->fd, values, values_len, err) && *err == NULL;
@@ -332,54 +719,78 @@ dg_debugwire_read_registers(dg_debugwire_t *dw, uint8_t start,
 
 
 bool
-dg_debugwire_cache_pc(dg_debugwire_t *dw, dg_error_t **err)
+dg_debugwire_read_context(dg_debugwire_t *dw, dg_error_t **err)
 {
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    tmp_pc = dg_debugwire_get_pc(dw, err);
-    if (*err != NULL)
+    // this takes three exchanges, and can't take less. the target answers
+    // the pc read and every read frame as soon as it gets them, over the same
+    // wire, so each one must close its own exchange. the frames reuse the pc
+    // as their counter, so it goes first. spl, sph and sreg can only be read
+    // through sram, that clobbers z, so the registers go before them.
+    if (!load_registers(dw, 0, 32, err))
         return false;
 
-    dg_debug_printf("PC = 0x%02x\n", tmp_pc);
-
-    return true;
-}
+    const uint64_t m = DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SREG) |
+        DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SP);
+    if ((dw->context.valid & m) == m)
+        return true;
 
-
-bool
-dg_debugwire_restore_pc(dg_debugwire_t *dw, dg_error_t **err)
-{
-    if (dw == NULL || err == NULL || *err != NULL)
+    // spl, sph and sreg are contiguous
+    uint8_t b[3];
+    if (!dg_debugwire_read_sram(dw, 0x5d, b, 3, err) || *err != NULL)
         return false;
 
-    return dg_debugwire_set_pc(dw, tmp_pc, err) && *err == NULL;
+    dw->context.sp = b[0] | (b[1] << 8);
+    dw->context.sreg = b[2];
+    dw->context.valid |= m;
+
+    return true;
 }
 
 
 bool
-dg_debugwire_cache_yz(dg_debugwire_t *dw, dg_error_t **err)
+dg_debugwire_read_pc(dg_debugwire_t *dw, uint16_t *pc, dg_error_t **err)
 {
-    if (dw == NULL || err == NULL || *err != NULL)
+    if (dw == NULL || pc == NULL || err == NULL || *err != NULL)
         return false;
 
-    if (!dg_debugwire_read_registers(dw, 28, tmp_reg, 4, err) || *err != NULL)
+    if (!load_pc(dw, err))
         return false;
 
-    for (size_t i = 0; i < 4; i++)
-        dg_debug_printf("R%d = 0x%02x\n", i + 28, tmp_reg[i]);
-
+    *pc = dw->context.pc;
     return true;
 }
 
 
+// entries selected by the mask are copied from ctx, and written to the target
+// just before the mcu runs again
 bool
-dg_debugwire_restore_yz(dg_debugwire_t *dw, dg_error_t **err)
+dg_debugwire_write_context(dg_debugwire_t *dw, uint64_t mask,
+    const dg_debugwire_context_t *ctx, dg_error_t **err)
 {
-    if (dw == NULL || err == NULL || *err != NULL)
+    if (dw == NULL || ctx == NULL || err == NULL || *err != NULL)
+        return false;
+
+    // every frame touches the pc, it must be known before anything is written
+    if (!load_pc(dw, err))
         return false;
 
-    return dg_debugwire_write_registers(dw, 28, tmp_reg, 4, err) && *err == NULL;
+    for (uint8_t i = 0; i < 32; i++)
+        if (mask & DG_DEBUGWIRE_CONTEXT_BIT(i))
+            dw->context.registers[i] = ctx->registers[i];
+    if (mask & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SREG))
+        dw->context.sreg = ctx->sreg;
+    if (mask & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SP))
+        dw->context.sp = ctx->sp;
+    if (mask & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_PC))
+        dw->context.pc = ctx->pc;
+
+    dw->context.valid |= mask;
+    dw->context.dirty |= mask;
+
+    return true;
 }
 
 
@@ -390,183 +801,1227 @@ dg_debugwire_read_sram(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    uint8_t b[2] = {
-        start, start >> 8,
-    };
+    if (((uint32_t) start) + values_len > 0x10000) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "SRAM read out of bounds: 0x%04x (%d bytes)", start, values_len);
+        return false;
+    }
 
-    if (!dg_debugwire_write_registers(dw, 30, b, 2, err) || *err != NULL)
+    if (values_len == 0)
+        return true;
+
+    // the register file is mapped at the start of sram. read it from the
+    // context, as the target copies of the clobbered registers are garbage
+    uint8_t regs = start < 32 ? (values_len < 32 - start ? values_len : 32 - start) : 0;
+    if (regs > 0 && !load_registers(dw, start, regs, err))
         return false;
 
-    const uint8_t c[10] = {
-        0x66,
-        0xc2, 0x00,
-        0xd0, 0x00, 0x00,
-        0xd1, (values_len * 2) >> 8, values_len * 2,
-        0x20,
-    };
-    if (10 != dg_serial_write(dw->fd, c, 10, err) || *err != NULL)
+    if (!clobber_registers(dw, 30, 2, err))
         return false;
 
-    return values_len == dg_serial_read(dw->fd, values, values_len, err)
-        && *err == NULL;
+    for (uint32_t i = 0; i < values_len; i += DG_DEBUGWIRE_MEMORY_CHUNK) {
+        uint16_t addr = start + i;
+        uint16_t len = values_len - i;
+        if (len > DG_DEBUGWIRE_MEMORY_CHUNK)
+            len = DG_DEBUGWIRE_MEMORY_CHUNK;
+
+        uint8_t b[2] = {
+            addr, addr >> 8,
+        };
+
+        if (!dg_debugwire_write_registers(dw, 30, b, 2, err) || *err != NULL)
+            return false;
+
+        const uint8_t c[10] = {
+            0x66,
+            0xc2, 0x00,
+            0xd0, 0x00, 0x00,
+            0xd1, (len * 2) >> 8, len * 2,
+            0x20,
+        };
+        if (!dg_serial_queue(dw->fd, c, 10, err) || *err != NULL)
+            return false;
+
+        if (len != dg_serial_read(dw->fd, values + i, len, err) || *err != NULL)
+            return false;
+    }
+
+    if (regs > 0)
+        memcpy(values, dw->context.registers + start, regs);
+
+    // spl, sph and sreg written by gdb only reach the target when it runs
+    // again, gdb must see them already
+    for (uint32_t addr = 0x5d; addr <= 0x5f; addr++) {
+        if (addr < start || addr >= ((uint32_t) start) + values_len)
+            continue;
+        switch (addr) {
+            case 0x5d:
+                if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SP))
+                    values[addr - start] = dw->context.sp;
+                break;
+            case 0x5e:
+                if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SP))
+                    values[addr - start] = dw->context.sp >> 8;
+                break;
+            case 0x5f:
+                if (dw->context.dirty & DG_DEBUGWIRE_CONTEXT_BIT(DG_DEBUGWIRE_CONTEXT_SREG))
+                    values[addr - start] = dw->context.sreg;
+                break;
+        }
+    }
+
+    return true;
 }
 
 
 bool
-dg_debugwire_read_flash(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
+dg_debugwire_write_sram(dg_debugwire_t *dw, uint16_t start, const uint8_t *values,
     uint16_t values_len, dg_error_t **err)
 {
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    const uint8_t b[2] = {
-        start, start >> 8,
-    };
-
-    if (!dg_debugwire_write_registers(dw, 30, b, 2, err) || *err != NULL)
+    if (((uint32_t) start) + values_len > 0x10000) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "SRAM write out of bounds: 0x%04x (%d bytes)", start, values_len);
         return false;
+    }
 
-    uint8_t c[10] = {
-        0x66,
-        0xc2, 0x02,
-        0xd0, 0x00, 0x00,
-        0xd1, (values_len * 2) >> 8, values_len * 2,
-        0x20,
-    };
-    if (10 != dg_serial_write(dw->fd, c, 10, err) || *err != NULL)
+    // z is needed for the write itself, so the register file goes to the
+    // context, and is written back with it
+    uint8_t regs = start < 32 ? (values_len < 32 - start ? values_len : 32 - start) : 0;
+    if (regs > 0) {
+        dg_debugwire_context_t ctx;
+        uint64_t mask = 0;
+        for (uint8_t i = 0; i < regs; i++) {
+            ctx.registers[start + i] = values[i];
+            mask |= DG_DEBUGWIRE_CONTEXT_BIT(start + i);
+        }
+        if (!dg_debugwire_write_context(dw, mask, &ctx, err))
+            return false;
+    }
+
+    if (regs == values_len)
+        return true;
+
+    if (!clobber_registers(dw, 30, 2, err))
         return false;
 
-    return values_len == dg_serial_read(dw->fd, values, values_len, err)
-        && *err == NULL;
-}
+    for (uint32_t i = regs; i < values_len; i += DG_DEBUGWIRE_MEMORY_CHUNK) {
+        uint16_t addr = start + i;
+        uint16_t len = values_len - i;
+        if (len > DG_DEBUGWIRE_MEMORY_CHUNK)
+            len = DG_DEBUGWIRE_MEMORY_CHUNK;
 
+        const uint8_t b[2] = {
+            addr, addr >> 8,
+        };
 
-bool
-dg_debugwire_write_instruction(dg_debugwire_t *dw, uint16_t inst,
-    dg_error_t **err)
-{
-    if (dw == NULL || err == NULL || *err != NULL)
-        return false;
+        if (!dg_debugwire_write_registers(dw, 30, b, 2, err) || *err != NULL)
+            return false;
 
-    const uint8_t b[5] = {
-        0x64,
-        0xd2, inst >> 8, inst,
-        0x23,
-    };
-    return 5 == dg_serial_write(dw->fd, b, 5, err) && *err == NULL;
-}
+        const uint8_t c[10] = {
+            0x66,
+            0xc2, 0x04,
+            0xd0, 0x00, 0x01,
+            0xd1, (len * 2 + 1) >> 8, len * 2 + 1,
+            0x20,
+        };
+        if (!dg_serial_queue(dw->fd, c, 10, err) || *err != NULL)
+            return false;
 
+        if (!dg_serial_queue(dw->fd, values + i, len, err) || *err != NULL)
+            return false;
 
-bool
-dg_debugwire_instruction_in(dg_debugwire_t *dw, uint8_t address, uint8_t reg,
-    dg_error_t **err)
-{
-    if (dw == NULL || err == NULL || *err != NULL)
-        return false;
+        // keep the cached stack pointer and status register coherent
+        for (uint16_t j = 0; j < len; j++) {
+            switch (addr + j) {
+                case 0x5d:
+                    dw->context.sp = (dw->context.sp & 0xff00) | values[i + j];
+                    break;
+                case 0x5e:
+                    dw->context.sp = (dw->context.sp & 0x00ff) | (values[i + j] << 8);
+                    break;
+                case 0x5f:
+                    dw->context.sreg = values[i + j];
+                    break;
+            }
+        }
+    }
 
-    return dg_debugwire_write_instruction(dw,
-        0xb000 | ((address & 0x30) << 5) | ((reg & 0x1f) << 4) | (address & 0x0f),
-        err) && *err == NULL;
+    return 0 <= dg_serial_commit(dw->fd, err) && *err == NULL;
 }
 
 
-bool
-dg_debugwire_instruction_out(dg_debugwire_t *dw, uint8_t address, uint8_t reg,
-    dg_error_t **err)
+static bool
+read_flash(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
+    uint16_t values_len, dg_error_t **err)
 {
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    return dg_debugwire_write_instruction(dw,
-        0xb800 | ((address & 0x30) << 5) | ((reg & 0x1f) << 4) | (address & 0x0f),
-        err) && *err == NULL;
-}
+    if (!clobber_registers(dw, 30, 2, err))
+        return false;
 
+    for (uint32_t i = 0; i < values_len; i += DG_DEBUGWIRE_MEMORY_CHUNK) {
+        uint16_t addr = start + i;
+        uint16_t len = values_len - i;
+        if (len > DG_DEBUGWIRE_MEMORY_CHUNK)
+            len = DG_DEBUGWIRE_MEMORY_CHUNK;
 
-char*
-dg_debugwire_get_fuses(dg_debugwire_t *dw, dg_error_t **err)
-{
-    if (dw == NULL || err == NULL || *err != NULL)
-        return NULL;
+        const uint8_t b[2] = {
+            addr, addr >> 8,
+        };
 
-    uint8_t b[3] = {
-        1 << 3 | 1 << 0,  // RFLB | SELFPRGEN
-        0,
-        0,
+        if (!dg_debugwire_write_registers(dw, 30, b, 2, err) || *err != NULL)
+            return false;
+
+        uint8_t c[10] = {
+            0x66,
+            0xc2, 0x02,
+            0xd0, 0x00, 0x00,
+            0xd1, (len * 2) >> 8, len * 2,
+            0x20,
+        };
+        if (!dg_serial_queue(dw->fd, c, 10, err) || *err != NULL)
+            return false;
+
+        if (len != dg_serial_read(dw->fd, values + i, len, err) || *err != NULL)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool
+dg_debugwire_read_flash(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
+    uint16_t values_len, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint32_t) start) + values_len > dw->dev->flash_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Flash read out of bounds: 0x%04x (%d bytes)", start, values_len);
+        return false;
+    }
+
+    if (values_len == 0)
+        return true;
+
+    size_t ps = dw->dev->flash_page_size;
+    size_t first = start / ps;
+    size_t last = (start + values_len - 1) / ps;
+
+    // consecutive missing pages are fetched with a single read
+    for (size_t i = first; i <= last; i++) {
+        if (dw->flash_cache_valid[i])
+            continue;
+
+        size_t j = i;
+        while (j + 1 <= last && !dw->flash_cache_valid[j + 1])
+            j++;
+
+        if (!read_flash(dw, i * ps, dw->flash_cache + (i * ps), (j - i + 1) * ps, err) ||
+            *err != NULL)
+            return false;
+
+        for (size_t k = i; k <= j; k++)
+            dw->flash_cache_valid[k] = true;
+
+        i = j;
+    }
+
+    memcpy(values, dw->flash_cache + start, values_len);
+
+    // gdb must see the original instructions, not our breaks
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        if (!dw->breakpoints[i].installed)
+            continue;
+        uint32_t addr = ((uint32_t) dw->breakpoints[i].address) * 2;
+        if (addr >= start && addr < ((uint32_t) start) + values_len)
+            values[addr - start] = dw->breakpoints[i].original;
+        if (addr + 1 >= start && addr + 1 < ((uint32_t) start) + values_len)
+            values[addr + 1 - start] = dw->breakpoints[i].original >> 8;
+    }
+
+    return true;
+}
+
+
+static uint16_t
+opcode_in(uint8_t address, uint8_t reg)
+{
+    return 0xb000 | ((address & 0x30) << 5) | ((reg & 0x1f) << 4) | (address & 0x0f);
+}
+
+
+static uint16_t
+opcode_out(uint8_t address, uint8_t reg)
+{
+    return 0xb800 | ((address & 0x30) << 5) | ((reg & 0x1f) << 4) | (address & 0x0f);
+}
+
+
+// only r16-r31
+static uint16_t
+opcode_ldi(uint8_t reg, uint8_t value)
+{
+    return 0xe000 | ((value & 0xf0) << 4) | ((reg & 0x0f) << 4) | (value & 0x0f);
+}
+
+
+// lpm rd, z
+static uint16_t
+opcode_lpm(uint8_t reg)
+{
+    return 0x9004 | ((reg & 0x1f) << 4);
+}
+
+
+bool
+dg_debugwire_write_instruction(dg_debugwire_t *dw, uint16_t inst,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    const uint8_t b[5] = {
+        0x64,
+        0xd2, inst >> 8, inst,
+        0x23,
     };
+    return dg_serial_queue(dw->fd, b, 5, err) && *err == NULL;
+}
+
+
+bool
+dg_debugwire_instruction_in(dg_debugwire_t *dw, uint8_t address, uint8_t reg,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    return dg_debugwire_write_instruction(dw, opcode_in(address, reg), err) &&
+        *err == NULL;
+}
 
-    const uint8_t f[4] = {
-        0,  // low fuse
-        3,  // high fuse
-        2,  // extended fuse
-        1   // lockbit
+
+bool
+dg_debugwire_instruction_out(dg_debugwire_t *dw, uint8_t address, uint8_t reg,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    return dg_debugwire_write_instruction(dw, opcode_out(address, reg), err) &&
+        *err == NULL;
+}
+
+
+// loads registers, runs instructions and reads registers back, in a single
+// serial transfer. the instructions must not touch any register outside of
+// the load and read ranges, that are restored before the mcu runs again.
+bool
+dg_debugwire_run_instructions(dg_debugwire_t *dw, uint8_t load_start,
+    const uint8_t *load, uint8_t load_len, const uint16_t *insts,
+    size_t insts_len, uint8_t read_start, uint8_t *read, uint8_t read_len,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint16_t) load_start) + load_len > 32 || ((uint16_t) read_start) + read_len > 32) {
+        *err = dg_error_new(DG_ERROR_DEBUGWIRE, "Invalid register range");
+        return false;
+    }
+
+    // original values of both ranges are fetched with a single read, if needed
+    uint8_t first = 32;
+    uint8_t last = 0;
+    if (load_len > 0) {
+        first = load_start;
+        last = load_start + load_len - 1;
+    }
+    if (read_len > 0) {
+        if (read_start < first)
+            first = read_start;
+        if (read_start + read_len - 1 > last)
+            last = read_start + read_len - 1;
+    }
+    if (first < 32 && !load_registers(dw, first, last - first + 1, err))
+        return false;
+    if (load_len > 0 && !clobber_registers(dw, load_start, load_len, err))
+        return false;
+    if (read_len > 0 && !clobber_registers(dw, read_start, read_len, err))
+        return false;
+
+    if (load_len > 0 && !dg_debugwire_write_registers(dw, load_start, load, load_len, err))
+        return false;
+
+    // the instruction mode is set once for the whole batch
+    const uint8_t m = 0x64;
+    if (insts_len > 0 && !dg_serial_queue(dw->fd, &m, 1, err))
+        return false;
+
+    for (size_t i = 0; i < insts_len; i++) {
+        const uint8_t b[4] = {
+            0xd2, insts[i] >> 8, insts[i],
+            0x23,
+        };
+        if (!dg_serial_queue(dw->fd, b, 4, err))
+            return false;
+    }
+
+    if (read_len > 0)
+        return dg_debugwire_read_registers(dw, read_start, read, read_len, err);
+
+    return 0 <= dg_serial_commit(dw->fd, err) && *err == NULL;
+}
+
+
+static bool
+run_spm(dg_debugwire_t *dw, uint8_t op, uint16_t addr, dg_error_t **err)
+{
+    const uint8_t b[3] = {
+        op,
+        addr, addr >> 8,
     };
+    if (!dg_debugwire_write_registers(dw, 29, b, 3, err))
+        return false;
 
-    dg_string_t *rv = dg_string_new();
+    if (!dg_debugwire_write_instruction(dw, opcode_out(0x37, 29), err))
+        return false;
 
-    for (size_t i = 0; i < 4; i++) {
-        b[1] = f[i];
+    // the cpu is halted until the spm is done, and then breaks
+    const uint8_t c[5] = {
+        0x64,
+        0xd2, 0x95, 0xe8,  // spm
+        0x33,
+    };
+    if (!dg_serial_queue(dw->fd, c, 5, err))
+        return false;
 
-        if (!dg_debugwire_write_registers(dw, 29, b, 3, err) || *err != NULL) {
-            dg_string_free(rv, true);
-            return NULL;
+    uint8_t d = dg_serial_recv_break(dw->fd, DG_DEBUGWIRE_SPM_TIMEOUT, err);
+    if (*err != NULL)
+        return false;
+
+    if (d != 0x55) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Bad break sent from MCU after spm. Expected 0x55, got 0x%02x", d);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool
+program_page(dg_debugwire_t *dw, uint16_t addr, const uint8_t *data,
+    dg_error_t **err)
+{
+    if (!clobber_registers(dw, 0, 2, err) || !clobber_registers(dw, 29, 3, err))
+        return false;
+
+    const uint8_t b[3] = {
+        1 << 0,  // SPMEN
+        addr, addr >> 8,
+    };
+    if (!dg_debugwire_write_registers(dw, 29, b, 3, err))
+        return false;
+
+    // the temporary page buffer is filled before the page erase, that keeps
+    // it. pages are aligned, so only zl changes. adiw would touch sreg.
+    for (uint16_t i = 0; i < dw->dev->flash_page_size; i += 2) {
+        if (!dg_debugwire_write_registers(dw, 0, data + i, 2, err))
+            return false;
+        if (!dg_debugwire_write_instruction(dw, opcode_ldi(30, addr + i), err))
+            return false;
+        if (!dg_debugwire_write_instruction(dw, opcode_out(0x37, 29), err))
+            return false;
+        if (!dg_debugwire_write_instruction(dw, 0x95e8, err))  // spm
+            return false;
+    }
+
+    if (!run_spm(dw, 1 << 1 | 1 << 0, addr, err))  // PGERS | SPMEN
+        return false;
+
+    return run_spm(dw, 1 << 2 | 1 << 0, addr, err);  // PGWRT | SPMEN
+}
+
+
+static bool
+stage_page(dg_debugwire_t *dw, size_t page, dg_error_t **err)
+{
+    if (dw->flash_staging_dirty[page])
+        return true;
+
+    size_t ps = dw->dev->flash_page_size;
+    if (!dg_debugwire_read_flash(dw, page * ps, dw->flash_staging + (page * ps),
+            ps, err))
+        return false;
+
+    dw->flash_staging_dirty[page] = true;
+    return true;
+}
+
+
+bool
+dg_debugwire_erase_flash(dg_debugwire_t *dw, uint16_t start, uint16_t len,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint32_t) start) + len > dw->dev->flash_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Flash erase out of bounds: 0x%04x (%d bytes)", start, len);
+        return false;
+    }
+
+    if (len == 0)
+        return true;
+
+    size_t ps = dw->dev->flash_page_size;
+    for (size_t i = start / ps; i <= (start + len - 1) / ps; i++)
+        if (!stage_page(dw, i, err))
+            return false;
+
+    memset(dw->flash_staging + start, 0xff, len);
+
+    return true;
+}
+
+
+bool
+dg_debugwire_queue_flash(dg_debugwire_t *dw, uint16_t start,
+    const uint8_t *values, uint16_t values_len, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint32_t) start) + values_len > dw->dev->flash_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Flash write out of bounds: 0x%04x (%d bytes)", start, values_len);
+        return false;
+    }
+
+    if (values_len == 0)
+        return true;
+
+    size_t ps = dw->dev->flash_page_size;
+    for (size_t i = start / ps; i <= (start + values_len - 1) / ps; i++)
+        if (!stage_page(dw, i, err))
+            return false;
+
+    memcpy(dw->flash_staging + start, values, values_len);
+
+    return true;
+}
+
+
+bool
+dg_debugwire_commit_flash(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    size_t ps = dw->dev->flash_page_size;
+    size_t pages = dw->dev->flash_size / ps;
+    size_t written = 0;
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < pages; i++) {
+        if (!dw->flash_staging_dirty[i])
+            continue;
+
+        uint8_t *page = dw->flash_staging + (i * ps);
+
+        // a reset in between may have invalidated the cached copy
+        if (!dw->flash_cache_valid[i]) {
+            if (!read_flash(dw, i * ps, dw->flash_cache + (i * ps), ps, err))
+                return false;
+            dw->flash_cache_valid[i] = true;
         }
 
-        if (!dg_debugwire_instruction_out(dw, 0x37, 29, err) || *err != NULL) {
-            dg_string_free(rv, true);
-            return NULL;
+        if (0 == memcmp(page, dw->flash_cache + (i * ps), ps)) {
+            dw->flash_staging_dirty[i] = false;
+            skipped++;
+            continue;
         }
 
-        if (!dg_debugwire_write_instruction(dw, 0x95c8, err) || *err != NULL) {
-            dg_string_free(rv, true);
-            return NULL;
+        dg_debug_printf(" * Programming flash page 0x%04x\n", i * ps);
+
+        if (!program_page(dw, i * ps, page, err))
+            return false;
+
+        memcpy(dw->flash_cache + (i * ps), page, ps);
+        dw->flash_cache_valid[i] = true;
+        dw->flash_staging_dirty[i] = false;
+        written++;
+
+        // a new program may have overwritten our breaks
+        for (size_t j = 0; j < dw->breakpoints_len; j++) {
+            uint32_t addr = ((uint32_t) dw->breakpoints[j].address) * 2;
+            if (!dw->breakpoints[j].installed || addr / ps != i)
+                continue;
+            if ((page[addr % ps] | (page[addr % ps + 1] << 8)) != DG_DEBUGWIRE_OPCODE_BREAK)
+                dw->breakpoints[j].installed = false;
         }
+    }
 
-        uint8_t r;
-        if (!dg_debugwire_read_registers(dw, 0, &r, 1, err) || *err != NULL) {
-            dg_string_free(rv, true);
-            return NULL;
+    dg_debug_printf(" * Flash pages programmed: %zu, unchanged: %zu\n", written,
+        skipped);
+
+    return true;
+}
+
+
+// breakpoints are just recorded when gdb asks for them, and the flash is
+// updated right before the mcu runs, so several changes on a page cost a
+// single page write. breaks stay resident in flash after gdb removes them,
+// as gdb removes and inserts every breakpoint around each resume. they are
+// only restored when their page is written anyway, when they are hit
+// without being requested, or when debugWIRE is disabled. whatever is left
+// in flash is recorded in the cache, for the next session.
+
+static bool
+is_two_words(uint16_t opcode)
+{
+    return (opcode & 0xfc0f) == 0x9000 ||  // lds, sts
+        (opcode & 0xfe0c) == 0x940c;       // jmp, call
+}
+
+
+// anything that may not fall through to the next instruction
+static bool
+is_branch(uint16_t opcode)
+{
+    return (opcode & 0xe000) == 0xc000 ||  // rjmp, rcall
+        (opcode & 0xf800) == 0xf000 ||     // brbs, brbc
+        (opcode & 0xfc00) == 0xfc00 ||     // sbrc, sbrs
+        (opcode & 0xfc00) == 0x1000 ||     // cpse
+        (opcode & 0xfd00) == 0x9900 ||     // sbic, sbis
+        (opcode & 0xfe0c) == 0x940c ||     // jmp, call
+        (opcode & 0xfeef) == 0x9409 ||     // ijmp, eijmp, icall, eicall
+        (opcode & 0xffef) == 0x9508 ||     // ret, reti
+        (opcode & 0xffef) == 0x9588 ||     // sleep, break
+        (opcode & 0xffef) == 0x95e8;       // spm
+}
+
+
+static bool
+save_breakpoints(dg_debugwire_t *dw)
+{
+    dg_cache_breakpoint_t *bps = dg_malloc(sizeof(dg_cache_breakpoint_t) *
+        (dw->breakpoints_len + 1));
+    size_t len = 0;
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        if (!dw->breakpoints[i].installed)
+            continue;
+        bps[len].address = dw->breakpoints[i].address;
+        bps[len].original = dw->breakpoints[i].original;
+        len++;
+    }
+    bool rv = dg_cache_store_breakpoints(dw->id, dw->dev->signature, bps, len);
+    free(bps);
+
+    // nothing left behind, nothing to remember
+    return rv || len == 0;
+}
+
+
+static bool
+load_breakpoints(dg_debugwire_t *dw, dg_error_t **err)
+{
+    size_t len;
+    dg_cache_breakpoint_t *bps = dg_cache_lookup_breakpoints(dw->id,
+        dw->dev->signature, &len);
+    if (bps == NULL)
+        return true;
+
+    // the target may have been reprogrammed by other means in between, only
+    // breaks still found in flash are ours
+    for (size_t i = 0; i < len; i++) {
+        if (((uint32_t) bps[i].address) * 2 + 2 > dw->dev->flash_size)
+            continue;
+
+        uint8_t v[2];
+        if (!dg_debugwire_read_flash(dw, bps[i].address * 2, v, 2, err)) {
+            free(bps);
+            return false;
         }
+        if ((v[0] | (v[1] << 8)) != DG_DEBUGWIRE_OPCODE_BREAK)
+            continue;
+
+        dg_debug_printf(" * Found resident breakpoint: 0x%04x\n",
+            bps[i].address * 2);
+
+        dw->breakpoints = dg_realloc(dw->breakpoints,
+            sizeof(dg_debugwire_breakpoint_t) * (dw->breakpoints_len + 1));
+        dw->breakpoints[dw->breakpoints_len].address = bps[i].address;
+        dw->breakpoints[dw->breakpoints_len].original = bps[i].original;
+        dw->breakpoints[dw->breakpoints_len].requested = false;
+        dw->breakpoints[dw->breakpoints_len].installed = true;
+        dw->breakpoints_len++;
+    }
 
-        switch (f[i]) {
-            case 0:
-                dg_string_append(rv, "low=");
-                break;
-            case 1:
-                dg_string_append(rv, "lockbit=");
-                break;
-            case 2:
-                dg_string_append(rv, "extended=");
-                break;
-            case 3:
-                dg_string_append(rv, "high=");
-                break;
+    free(bps);
+    save_breakpoints(dw);
+
+    return true;
+}
+
+
+static dg_debugwire_breakpoint_t*
+get_breakpoint(dg_debugwire_t *dw, uint16_t address)
+{
+    for (size_t i = 0; i < dw->breakpoints_len; i++)
+        if (dw->breakpoints[i].address == address)
+            return &dw->breakpoints[i];
+    return NULL;
+}
+
+
+bool
+dg_debugwire_add_breakpoint(dg_debugwire_t *dw, uint16_t address,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint32_t) address) * 2 + 2 > dw->dev->flash_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "Breakpoint out of bounds: 0x%04x", address * 2);
+        return false;
+    }
+
+    dg_debugwire_breakpoint_t *b = get_breakpoint(dw, address);
+    if (b != NULL) {
+        b->requested = true;
+        return true;
+    }
+
+    dw->breakpoints = dg_realloc(dw->breakpoints,
+        sizeof(dg_debugwire_breakpoint_t) * (dw->breakpoints_len + 1));
+    dw->breakpoints[dw->breakpoints_len].address = address;
+    dw->breakpoints[dw->breakpoints_len].original = 0;
+    dw->breakpoints[dw->breakpoints_len].requested = true;
+    dw->breakpoints[dw->breakpoints_len].installed = false;
+    dw->breakpoints_len++;
+
+    return true;
+}
+
+
+bool
+dg_debugwire_remove_breakpoint(dg_debugwire_t *dw, uint16_t address,
+    dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    dg_debugwire_breakpoint_t *b = get_breakpoint(dw, address);
+    if (b != NULL)
+        b->requested = false;
+
+    return true;
+}
+
+
+static bool
+update_breakpoints(dg_debugwire_t *dw, bool purge, dg_error_t **err)
+{
+    bool changed = false;
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        dg_debugwire_breakpoint_t *b = &dw->breakpoints[i];
+        if ((b->requested && !b->installed) || (purge && !b->requested && b->installed)) {
+            changed = true;
+            break;
+        }
+    }
+    if (!changed)
+        return true;
+
+    uint8_t v[2];
+
+    // missing breaks are staged first, then the pages touched decide which
+    // resident breaks are staged again. the shadowed reads used for staging
+    // restore every original, so unrequested breaks on those pages go away
+    // for free.
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        dg_debugwire_breakpoint_t *b = &dw->breakpoints[i];
+        if (b->requested && !b->installed) {
+            if (!dg_debugwire_read_flash(dw, b->address * 2, v, 2, err))
+                return false;
+            b->original = v[0] | (v[1] << 8);
+
+            v[0] = DG_DEBUGWIRE_OPCODE_BREAK & 0xff;
+            v[1] = DG_DEBUGWIRE_OPCODE_BREAK >> 8;
+            if (!dg_debugwire_queue_flash(dw, b->address * 2, v, 2, err))
+                return false;
         }
+        else if (purge && !b->requested && b->installed) {
+            v[0] = b->original;
+            v[1] = b->original >> 8;
+            if (!dg_debugwire_queue_flash(dw, b->address * 2, v, 2, err))
+                return false;
+        }
+    }
 
-        dg_string_append_printf(rv, "0x%02x", r);
+    size_t ps = dw->dev->flash_page_size;
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        dg_debugwire_breakpoint_t *b = &dw->breakpoints[i];
+        if (b->requested && b->installed &&
+            dw->flash_staging_dirty[(b->address * 2) / ps]) {
+            v[0] = DG_DEBUGWIRE_OPCODE_BREAK & 0xff;
+            v[1] = DG_DEBUGWIRE_OPCODE_BREAK >> 8;
+            if (!dg_debugwire_queue_flash(dw, b->address * 2, v, 2, err))
+                return false;
+        }
+    }
 
-        if (i < 3)
-            dg_string_append(rv, ", ");
+    // installed state of breaks on programmed pages is updated by the commit
+    if (!dg_debugwire_commit_flash(dw, err))
+        return false;
+
+    size_t j = 0;
+    for (size_t i = 0; i < dw->breakpoints_len; i++) {
+        if (dw->breakpoints[i].requested)
+            dw->breakpoints[i].installed = true;
+        if (dw->breakpoints[i].requested || dw->breakpoints[i].installed)
+            dw->breakpoints[j++] = dw->breakpoints[i];
     }
+    dw->breakpoints_len = j;
 
-    return dg_string_free(rv, false);
+    save_breakpoints(dw);
+
+    return true;
 }
 
 
 bool
-dg_debugwire_step(dg_debugwire_t *dw, dg_error_t **err)
+dg_debugwire_sync_breakpoints(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    return update_breakpoints(dw, false, err);
+}
+
+
+bool
+dg_debugwire_purge_breakpoints(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    return update_breakpoints(dw, true, err);
+}
+
+
+bool
+dg_debugwire_clear_breakpoints(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    for (size_t i = 0; i < dw->breakpoints_len; i++)
+        dw->breakpoints[i].requested = false;
+
+    return update_breakpoints(dw, true, err);
+}
+
+
+bool
+dg_debugwire_release_breakpoints(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    for (size_t i = 0; i < dw->breakpoints_len; i++)
+        dw->breakpoints[i].requested = false;
+
+    // with no cache to remember them, breaks can't be left behind
+    if (save_breakpoints(dw))
+        return true;
+
+    return update_breakpoints(dw, true, err);
+}
+
+bool
+dg_debugwire_check_stale_breakpoint(dg_debugwire_t *dw, bool *stale,
+    dg_error_t **err)
+{
+    if (dw == NULL || stale == NULL || err == NULL || *err != NULL)
+        return false;
+
+    *stale = false;
+
+    if (!load_pc(dw, err))
+        return false;
+
+    dg_debugwire_breakpoint_t *b = get_breakpoint(dw, dw->context.pc);
+    if (b == NULL || b->requested || !b->installed)
+        return true;
+    if (dw->hw_breakpoint_set && dw->hw_breakpoint == dw->context.pc)
+        return true;
+
+    // gdb inserts every breakpoint it wants before resuming, so this one was
+    // deleted. the pc points to it, and the original instruction runs next
+    dg_debug_printf(" * Removing stale breakpoint: 0x%04x\n", dw->context.pc * 2);
+    *stale = true;
+
+    return update_breakpoints(dw, true, err);
+}
+
+
+bool
+dg_debugwire_has_breakpoint(dg_debugwire_t *dw, uint16_t address)
+{
+    if (dw == NULL)
+        return false;
+
+    if (dw->hw_breakpoint_set && dw->hw_breakpoint == address)
+        return true;
+
+    dg_debugwire_breakpoint_t *b = get_breakpoint(dw, address);
+    return b != NULL && b->requested;
+}
+
+
+// nothing before the returned address may leave the straight line, so the
+// mcu can run up to it at full speed. end is returned if there's no branch.
+bool
+dg_debugwire_find_branch(dg_debugwire_t *dw, uint16_t start, uint16_t end,
+    uint16_t *branch, dg_error_t **err)
+{
+    if (dw == NULL || branch == NULL || err == NULL || *err != NULL)
+        return false;
+
+    *branch = end;
+
+    if (((uint32_t) end) * 2 > dw->dev->flash_size)
+        end = dw->dev->flash_size / 2;
+    if (start >= end)
+        return true;
+
+    // shadowed read, breaks show up as the instructions they replace
+    uint16_t len = (end - start) * 2;
+    uint8_t *buf = dg_malloc(len);
+    if (!dg_debugwire_read_flash(dw, start * 2, buf, len, err)) {
+        free(buf);
+        return false;
+    }
+
+    for (uint16_t i = 0; i < len; i += 2) {
+        uint16_t op = buf[i] | (buf[i + 1] << 8);
+        if (is_branch(op)) {
+            *branch = start + i / 2;
+            break;
+        }
+        if (is_two_words(op))
+            i += 2;
+    }
+
+    free(buf);
+
+    return true;
+}
+
+
+// a break at the pc is not executed: its original instruction is loaded
+// into the debugWIRE instruction register and the mcu resumes from it.
+// two-word instructions can't be loaded, and the break is removed instead.
+static bool
+get_resume_instruction(dg_debugwire_t *dw, bool *loaded, uint16_t *inst,
+    dg_error_t **err)
+{
+    *loaded = false;
+
+    if (!load_pc(dw, err))
+        return false;
+
+    dg_debugwire_breakpoint_t *b = get_breakpoint(dw, dw->context.pc);
+    if (b == NULL || !b->installed)
+        return true;
+
+    if (is_two_words(b->original)) {
+        b->requested = false;
+        return update_breakpoints(dw, true, err);
+    }
+
+    *loaded = true;
+    *inst = b->original;
+    return true;
+}
+
+// eeprom is reached through EEARH (0x1f), EEARL (0x1e), EEDR (0x1d) and
+// EECR (0x1c). addresses are set with ldi, as adiw would touch sreg.
+
+bool
+dg_debugwire_read_eeprom(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
+    uint16_t values_len, dg_error_t **err)
 {
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    const uint8_t b[2] = {
-        0x60,
-        0x31,
+    if (((uint32_t) start) + values_len > dw->dev->eeprom_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "EEPROM read out of bounds: 0x%04x (%d bytes)", start, values_len);
+        return false;
+    }
+
+    const uint8_t b[3] = {
+        1 << 0,  // EERE
+        0,
+        0,
+    };
+
+    for (uint32_t i = 0; i < values_len; i += DG_DEBUGWIRE_EEPROM_CHUNK) {
+        uint8_t len = DG_DEBUGWIRE_EEPROM_CHUNK;
+        if (values_len - i < len)
+            len = values_len - i;
+
+        uint16_t insts[DG_DEBUGWIRE_EEPROM_CHUNK * 6];
+        size_t insts_len = 0;
+
+        for (uint8_t j = 0; j < len; j++) {
+            uint16_t addr = start + i + j;
+            if (j == 0 || (addr & 0xff) == 0) {
+                insts[insts_len++] = opcode_ldi(31, addr >> 8);
+                insts[insts_len++] = opcode_out(0x1f, 31);
+            }
+            insts[insts_len++] = opcode_ldi(30, addr);
+            insts[insts_len++] = opcode_out(0x1e, 30);
+            insts[insts_len++] = opcode_out(0x1c, 29);
+            insts[insts_len++] = opcode_in(0x1d, j);
+        }
+
+        // r30 and r31 are loaded too, as ldi changes them
+        if (!dg_debugwire_run_instructions(dw, 29, b, 3, insts, insts_len,
+                0, values + i, len, err))
+            return false;
+    }
+
+    return true;
+}
+
+
+static bool
+wait_eeprom(dg_debugwire_t *dw, dg_error_t **err)
+{
+    const uint16_t inst = opcode_in(0x1c, 0);
+
+    for (size_t i = 0; i < DG_DEBUGWIRE_EEPROM_POLL_MAX; i++) {
+        uint8_t eecr;
+        if (!dg_debugwire_run_instructions(dw, 0, NULL, 0, &inst, 1, 0, &eecr, 1, err))
+            return false;
+        if (!(eecr & (1 << 1)))  // EEPE
+            return true;
+    }
+
+    *err = dg_error_new(DG_ERROR_DEBUGWIRE, "Timed out waiting for EEPROM write");
+    return false;
+}
+
+
+bool
+dg_debugwire_write_eeprom(dg_debugwire_t *dw, uint16_t start,
+    const uint8_t *values, uint16_t values_len, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (((uint32_t) start) + values_len > dw->dev->eeprom_size) {
+        *err = dg_error_new_printf(DG_ERROR_DEBUGWIRE,
+            "EEPROM write out of bounds: 0x%04x (%d bytes)", start, values_len);
+        return false;
+    }
+
+    if (values_len == 0)
+        return true;
+
+    // bytes that are already right are not written again. that's quicker,
+    // and saves eeprom endurance
+    uint8_t *current = dg_malloc(values_len);
+    if (!dg_debugwire_read_eeprom(dw, start, current, values_len, err)) {
+        free(current);
+        return false;
+    }
+
+    bool rv = true;
+    size_t written = 0;
+
+    for (uint16_t i = 0; i < values_len; i++) {
+        if (current[i] == values[i])
+            continue;
+
+        // the program may have started a write before halting
+        if (!wait_eeprom(dw, err)) {
+            rv = false;
+            break;
+        }
+
+        uint16_t addr = start + i;
+        const uint8_t b[6] = {
+            1 << 2,  // EEMPE, also selects atomic erase and write
+            1 << 1,  // EEPE
+            values[i],
+            0,
+            addr, addr >> 8,
+        };
+        const uint16_t insts[5] = {
+            opcode_out(0x1f, 31),
+            opcode_out(0x1e, 30),
+            opcode_out(0x1d, 28),
+            opcode_out(0x1c, 26),
+            opcode_out(0x1c, 27),
+        };
+        if (!dg_debugwire_run_instructions(dw, 26, b, 6, insts, 5, 0, NULL, 0, err)) {
+            rv = false;
+            break;
+        }
+        written++;
+    }
+
+    free(current);
+
+    if (rv)
+        rv = wait_eeprom(dw, err);
+
+    dg_debug_printf(" * EEPROM bytes written: %zu, unchanged: %zu\n", written,
+        values_len - written);
+
+    return rv;
+}
+
+
+bool
+dg_debugwire_get_info(dg_debugwire_t *dw, dg_debugwire_info_t *info,
+    dg_error_t **err)
+{
+    if (dw == NULL || info == NULL || err == NULL || *err != NULL)
+        return false;
+
+    const uint8_t b[4] = {
+        1 << 5 | 1 << 0,  // RSIG | SELFPRGEN
+        1 << 3 | 1 << 0,  // RFLB | SELFPRGEN
+        0,
+        0,
+    };
+
+    // everything is read by lpm right after setting SPMCSR, with the z pointer
+    // selecting the byte. results go to r0-r7, in this order.
+    const struct {
+        uint8_t spmcsr_reg;
+        uint8_t z;
+    } f[8] = {
+        {29, 0},  // low fuse
+        {29, 3},  // high fuse
+        {29, 2},  // extended fuse
+        {29, 1},  // lockbits
+        {28, 0},  // signature byte 0
+        {28, 2},  // signature byte 1
+        {28, 4},  // signature byte 2
+        {28, 1},  // oscillator calibration byte
     };
-    if (2 != dg_serial_write(dw->fd, b, 2, err) || *err != NULL)
+
+    uint16_t insts[8 * 3 + 1];
+    size_t insts_len = 0;
+    for (size_t i = 0; i < 8; i++) {
+        insts[insts_len++] = opcode_ldi(30, f[i].z);
+        insts[insts_len++] = opcode_out(0x37, f[i].spmcsr_reg);
+        insts[insts_len++] = opcode_lpm(i);
+    }
+    insts[insts_len++] = opcode_in(0x31, 8);  // OSCCAL
+
+    uint8_t r[9];
+    if (!dg_debugwire_run_instructions(dw, 28, b, 4, insts, insts_len, 0, r, 9, err) ||
+        *err != NULL)
         return false;
 
-    uint8_t d = dg_serial_recv_break(dw->fd, err);
+    info->low_fuse = r[0];
+    info->high_fuse = r[1];
+    info->extended_fuse = r[2];
+    info->lockbits = r[3];
+    info->signature[0] = r[4];
+    info->signature[1] = r[5];
+    info->signature[2] = r[6];
+    info->calibration = r[7];
+    info->osccal = r[8];
+
+    return true;
+}
+
+
+char*
+dg_debugwire_get_fuses(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return NULL;
+
+    dg_debugwire_info_t info;
+    if (!dg_debugwire_get_info(dw, &info, err) || *err != NULL)
+        return NULL;
+
+    return dg_strdup_printf("low=0x%02x, high=0x%02x, extended=0x%02x, lockbit=0x%02x",
+        info.low_fuse, info.high_fuse, info.extended_fuse, info.lockbits);
+}
+
+
+char*
+dg_debugwire_get_info_string(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return NULL;
+
+    dg_debugwire_info_t info;
+    if (!dg_debugwire_get_info(dw, &info, err) || *err != NULL)
+        return NULL;
+
+    return dg_strdup_printf(
+        "Target device: %s\n"
+        "Target device signature: 0x%02x%02x%02x\n"
+        "Target device fuses: low=0x%02x, high=0x%02x, extended=0x%02x, lockbit=0x%02x\n"
+        "Target device calibration: factory=0x%02x, osccal=0x%02x\n",
+        dw->dev->name, info.signature[0], info.signature[1], info.signature[2],
+        info.low_fuse, info.high_fuse, info.extended_fuse, info.lockbits,
+        info.calibration, info.osccal);
+}
+
+bool
+dg_debugwire_step(dg_debugwire_t *dw, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (!dg_debugwire_sync_breakpoints(dw, err))
+        return false;
+
+    bool loaded;
+    uint16_t inst;
+    if (!get_resume_instruction(dw, &loaded, &inst, err))
+        return false;
+
+    if (!restore_context(dw, err))
+        return false;
+
+    size_t l = loaded ? 5 : 2;
+    size_t i = 0;
+    uint8_t b[5];
+    b[i++] = 0x60;
+    if (loaded) {
+        b[i++] = 0xd2;
+        b[i++] = inst >> 8;
+        b[i++] = inst;
+    }
+    b[i++] = loaded ? 0x33 : 0x31;
+    if ((int) l != dg_serial_write(dw->fd, b, l, err) || *err != NULL)
+        return false;
+
+    uint8_t d = dg_serial_recv_break(dw->fd, DG_SERIAL_TIMEOUT_AUTO, err);
     if (d != 0x55) {
         if (*err != NULL)
             return false;
@@ -585,15 +2040,31 @@ dg_debugwire_continue(dg_debugwire_t *dw, dg_error_t **err)
     if (dw == NULL || err == NULL || *err != NULL)
         return false;
 
-    size_t l = dw->hw_breakpoint_set ? 5 : 2;
+    if (!dg_debugwire_sync_breakpoints(dw, err))
+        return false;
+
+    bool loaded;
+    uint16_t inst;
+    if (!get_resume_instruction(dw, &loaded, &inst, err))
+        return false;
+
+    if (!restore_context(dw, err))
+        return false;
+
+    size_t l = (dw->hw_breakpoint_set ? 3 : 0) + (loaded ? 3 : 0) + 2;
     size_t i = 0;
-    uint8_t b[l];
+    uint8_t b[8];
     if (dw->hw_breakpoint_set) {
         b[i++] = 0xd1;
         b[i++] = dw->hw_breakpoint >> 8;
         b[i++] = dw->hw_breakpoint;
     }
     b[i++] = dw->hw_breakpoint_set ? (dw->timer ? 0x41 : 0x61) : (dw->timer ? 0x40 : 0x60);
-    b[i++] = 0x30;
-    return l == dg_serial_write(dw->fd, b, l, err) && *err == NULL;
+    if (loaded) {
+        b[i++] = 0xd2;
+        b[i++] = inst >> 8;
+        b[i++] = inst;
+    }
+    b[i++] = loaded ? 0x32 : 0x30;
+    return (int) l == dg_serial_write(dw->fd, b, l, err) && *err == NULL;
 }
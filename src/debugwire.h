@@ -10,6 +10,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "error.h"
@@ -18,9 +19,44 @@
 typedef struct {
     const char *name;
     uint16_t signature;
+    uint16_t flash_size;
+    uint16_t flash_page_size;
+    uint16_t eeprom_size;
 } dg_debugwire_device_t;
 
+// bits of the context valid/dirty masks. bits 0-31 are the registers.
+#define DG_DEBUGWIRE_CONTEXT_SREG 32
+#define DG_DEBUGWIRE_CONTEXT_SP 33
+#define DG_DEBUGWIRE_CONTEXT_PC 34
+
+typedef struct {
+    uint8_t registers[32];
+    uint8_t sreg;
+    uint16_t sp;
+    uint16_t pc;
+    uint64_t valid;
+    uint64_t dirty;
+} dg_debugwire_context_t;
+
+typedef struct {
+    uint16_t address;  // in words
+    uint16_t original;
+    bool requested;
+    bool installed;
+} dg_debugwire_breakpoint_t;
+
+typedef struct {
+    uint8_t signature[3];
+    uint8_t low_fuse;
+    uint8_t high_fuse;
+    uint8_t extended_fuse;
+    uint8_t lockbits;
+    uint8_t calibration;
+    uint8_t osccal;
+} dg_debugwire_info_t;
+
 typedef struct {
+    char *id;
     char *device;
     uint32_t baudrate;
     int fd;
@@ -28,6 +64,13 @@ typedef struct {
     bool timer;
     uint16_t hw_breakpoint;
     bool hw_breakpoint_set;
+    uint8_t *flash_cache;
+    bool *flash_cache_valid;
+    uint8_t *flash_staging;
+    bool *flash_staging_dirty;
+    dg_debugwire_context_t context;
+    dg_debugwire_breakpoint_t *breakpoints;
+    size_t breakpoints_len;
 } dg_debugwire_t;
 
 dg_debugwire_t* dg_debugwire_new(const char *device, uint32_t baudrate,
@@ -42,12 +85,14 @@ bool dg_debugwire_write_registers(dg_debugwire_t *dw, uint8_t start,
     const uint8_t *values, uint8_t values_len, dg_error_t **err);
 bool dg_debugwire_read_registers(dg_debugwire_t *dw, uint8_t start,
     uint8_t *values, uint8_t values_len, dg_error_t **err);
-bool dg_debugwire_cache_pc(dg_debugwire_t *dw, dg_error_t **err);
-bool dg_debugwire_restore_pc(dg_debugwire_t *dw, dg_error_t **err);
-bool dg_debugwire_cache_yz(dg_debugwire_t *dw, dg_error_t **err);
-bool dg_debugwire_restore_yz(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_read_context(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_read_pc(dg_debugwire_t *dw, uint16_t *pc, dg_error_t **err);
+bool dg_debugwire_write_context(dg_debugwire_t *dw, uint64_t mask,
+    const dg_debugwire_context_t *ctx, dg_error_t **err);
 bool dg_debugwire_read_sram(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
     uint16_t values_len, dg_error_t **err);
+bool dg_debugwire_write_sram(dg_debugwire_t *dw, uint16_t start,
+    const uint8_t *values, uint16_t values_len, dg_error_t **err);
 bool dg_debugwire_read_flash(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
     uint16_t values_len, dg_error_t **err);
 bool dg_debugwire_write_instruction(dg_debugwire_t *dw, uint16_t inst,
@@ -56,6 +101,35 @@ bool dg_debugwire_instruction_in(dg_debugwire_t *dw, uint8_t address,
     uint8_t reg, dg_error_t **err);
 bool dg_debugwire_instruction_out(dg_debugwire_t *dw, uint8_t address,
     uint8_t reg, dg_error_t **err);
+bool dg_debugwire_run_instructions(dg_debugwire_t *dw, uint8_t load_start,
+    const uint8_t *load, uint8_t load_len, const uint16_t *insts,
+    size_t insts_len, uint8_t read_start, uint8_t *read, uint8_t read_len,
+    dg_error_t **err);
+bool dg_debugwire_erase_flash(dg_debugwire_t *dw, uint16_t start, uint16_t len,
+    dg_error_t **err);
+bool dg_debugwire_queue_flash(dg_debugwire_t *dw, uint16_t start,
+    const uint8_t *values, uint16_t values_len, dg_error_t **err);
+bool dg_debugwire_commit_flash(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_add_breakpoint(dg_debugwire_t *dw, uint16_t address,
+    dg_error_t **err);
+bool dg_debugwire_remove_breakpoint(dg_debugwire_t *dw, uint16_t address,
+    dg_error_t **err);
+bool dg_debugwire_sync_breakpoints(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_purge_breakpoints(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_clear_breakpoints(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_release_breakpoints(dg_debugwire_t *dw, dg_error_t **err);
+bool dg_debugwire_check_stale_breakpoint(dg_debugwire_t *dw, bool *stale,
+    dg_error_t **err);
+bool dg_debugwire_has_breakpoint(dg_debugwire_t *dw, uint16_t address);
+bool dg_debugwire_find_branch(dg_debugwire_t *dw, uint16_t start, uint16_t end,
+    uint16_t *branch, dg_error_t **err);
+bool dg_debugwire_read_eeprom(dg_debugwire_t *dw, uint16_t start, uint8_t *values,
+    uint16_t values_len, dg_error_t **err);
+bool dg_debugwire_write_eeprom(dg_debugwire_t *dw, uint16_t start,
+    const uint8_t *values, uint16_t values_len, dg_error_t **err);
+bool dg_debugwire_get_info(dg_debugwire_t *dw, dg_debugwire_info_t *info,
+    dg_error_t **err);
 char* dg_debugwire_get_fuses(dg_debugwire_t *dw, dg_error_t **err);
+char* dg_debugwire_get_info_string(dg_debugwire_t *dw, dg_error_t **err);
 bool dg_debugwire_step(dg_debugwire_t *dw, dg_error_t **err);
 bool dg_debugwire_continue(dg_debugwire_t *dw, dg_error_t **err);
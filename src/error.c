@@ -81,6 +81,7 @@ dg_error_print(dg_error_t *err)
             fprintf(stderr, "error: utils: %s\n", err->msg);
             break;
         case DG_ERROR_SERIAL:
+        case DG_ERROR_SERIAL_TIMEOUT:
             fprintf(stderr, "error: serial: %s\n", err->msg);
             break;
         case DG_ERROR_GDBSERVER:
@@ -89,6 +90,9 @@ dg_error_print(dg_error_t *err)
         case DG_ERROR_DEBUGWIRE:
             fprintf(stderr, "error: debugwire: %s\n", err->msg);
             break;
+        case DG_ERROR_AGENT:
+            fprintf(stderr, "error: agent: %s\n", err->msg);
+            break;
         default:
             fprintf(stderr, "error: %s\n", err->msg);
     }
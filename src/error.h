@@ -15,8 +15,10 @@
 typedef enum {
     DG_ERROR_UTILS = 1,
     DG_ERROR_SERIAL,
+    DG_ERROR_SERIAL_TIMEOUT,
     DG_ERROR_GDBSERVER,
     DG_ERROR_DEBUGWIRE,
+    DG_ERROR_AGENT,
 } dg_error_type_t;
 
 typedef struct {
@@ -21,114 +21,1124 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "agent.h"
 #include "debug.h"
 #include "debugwire.h"
 #include "error.h"
+#include "hex.h"
 #include "utils.h"
 #include "gdbserver.h"
 
+// big enough to keep the link busy, small enough for the stack
+#define DG_GDBSERVER_READ_CHUNK 1024
+
+// packets are buffered in a growable string and replies are streamed, so the
+// size gdb is told is only a sanity limit. big enough for the largest flash
+// in a single X packet.
+#define DG_GDBSERVER_PACKET_SIZE 0x10000
+
+// watched bytes are read as a single span after each step
+#define DG_GDBSERVER_WATCH_SPAN 64
+
+// bytes read from gdb and not parsed yet. a single read may bring several
+// packets, or a ctrl-c right after a packet
+static char rx[DG_GDBSERVER_READ_CHUNK];
+static size_t rx_start = 0;
+static size_t rx_end = 0;
+
+// the last packet sent, kept to be sent again if gdb asks for it. the
+// buffer only grows, and is reused by every reply in the session
+static char *reply = NULL;
+static size_t reply_len = 0;
+static size_t reply_size = 0;
+
+// once gdb negotiates QStartNoAckMode, packets are no longer acknowledged.
+// the link is tcp, acks would only add a round trip per command
+static bool no_ack = false;
+
 
 static char*
 get_ip(int af, const struct sockaddr *addr)
 {
-    char host[INET6_ADDRSTRLEN];
-    if (af == AF_INET6) {
-        struct sockaddr_in6 *a = (struct sockaddr_in6*) addr;
-        inet_ntop(af, &(a->sin6_addr), host, INET6_ADDRSTRLEN);
+    char host[INET6_ADDRSTRLEN];
+    if (af == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6*) addr;
+        inet_ntop(af, &(a->sin6_addr), host, INET6_ADDRSTRLEN);
+    }
+    else {
+        struct sockaddr_in *a = (struct sockaddr_in*) addr;
+        inet_ntop(af, &(a->sin_addr), host, INET6_ADDRSTRLEN);
+    }
+    return dg_strdup(host);
+}
+
+
+static u_int16_t
+get_port(int af, const struct sockaddr *addr)
+{
+    in_port_t port = 0;
+    if (af == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6*) addr;
+        port = a->sin6_port;
+    }
+    else {
+        struct sockaddr_in *a = (struct sockaddr_in*) addr;
+        port = a->sin_port;
+    }
+    return ntohs(port);
+}
+
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    size_t n = 0;
+    while (n < len) {
+        ssize_t r = write(fd, buf + n, len - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return;
+        n += r;
+    }
+}
+
+
+// responses are built in pieces, and sent with a single write when done.
+// the checksum is computed along the way.
+
+static char*
+reserve_response(size_t len)
+{
+    if (reply_len + len > reply_size) {
+        while (reply_len + len > reply_size)
+            reply_size = reply_size == 0 ? DG_GDBSERVER_READ_CHUNK : reply_size * 2;
+        reply = dg_realloc(reply, reply_size);
+    }
+    char *rv = reply + reply_len;
+    reply_len += len;
+    return rv;
+}
+
+
+static void
+write_response_start(uint8_t *checksum)
+{
+    *checksum = 0;
+    reply_len = 0;
+    *reserve_response(1) = '$';
+}
+
+
+static void
+write_response_append(uint8_t *checksum, const char *buf, size_t len)
+{
+    *checksum = dg_hex_checksum(buf, len, *checksum);
+    memcpy(reserve_response(len), buf, len);
+}
+
+
+// encodes straight into the reply, no intermediate buffers
+static void
+write_response_append_hex(uint8_t *checksum, const uint8_t *buf, size_t len)
+{
+    dg_hex_encode(buf, len, reserve_response(len * 2), checksum);
+}
+
+
+static void
+write_response_end(int fd, uint8_t checksum)
+{
+    char *c = reserve_response(3);
+    c[0] = '#';
+    dg_hex_encode(&checksum, 1, c + 1, NULL);
+    write_all(fd, reply, reply_len);
+}
+
+
+static void
+write_response(int fd, const char *resp)
+{
+    dg_debug_printf("$> command: %s\n", resp);
+
+    uint8_t c;
+    write_response_start(&c);
+    write_response_append(&c, resp, strlen(resp));
+    write_response_end(fd, c);
+}
+
+
+static void
+write_console(int fd, const char *msg)
+{
+    dg_debug_printf("$> console: %s", msg);
+
+    uint8_t c;
+    write_response_start(&c);
+    write_response_append(&c, "O", 1);
+    write_response_append_hex(&c, (const uint8_t*) msg, strlen(msg));
+    write_response_end(fd, c);
+}
+
+
+// debugWIRE has no data breakpoints. while sram watchpoints are set the
+// program is single stepped, and the watched bytes compared after each
+// step. an optional pc range (byte addresses) limits the stepping, the
+// program runs at full speed up to the start of the range.
+
+typedef struct {
+    uint16_t address;  // in sram
+    uint16_t len;
+} watchpoint_t;
+
+static watchpoint_t *watchpoints = NULL;
+static size_t watchpoints_len = 0;
+static bool watch_range_set = false;
+static uint32_t watch_range_start = 0;
+static uint32_t watch_range_end = 0;
+
+
+static int
+handle_monitor(dg_debugwire_t *dw, int fd, const char *hex, dg_error_t **err)
+{
+    size_t len = strlen(hex) / 2;
+    char *cmd = dg_malloc(len + 1);
+    if (!dg_hex_decode(hex, len, (uint8_t*) cmd)) {
+        write_response(fd, "E01");
+        free(cmd);
+        return 0;
+    }
+    cmd[len] = '\0';
+
+    dg_debug_printf("$< monitor: %s\n", cmd);
+
+    char *out = NULL;
+    if (0 == strcmp(cmd, "info")) {
+        out = dg_debugwire_get_info_string(dw, err);
+        if (out == NULL || *err != NULL) {
+            free(cmd);
+            return 1;
+        }
+    }
+    else if (0 == strncmp(cmd, "watch-range", 11) && (cmd[11] == '\0' || cmd[11] == ' ')) {
+        char *end;
+        uint32_t start = strtoul(cmd + 11, &end, 0);
+        uint32_t stop = strtoul(end, &end, 0);
+        if (*end != '\0' || start >= stop) {
+            watch_range_set = false;
+            out = dg_strdup("Watchpoints apply to the whole program\n");
+        }
+        else {
+            watch_range_set = true;
+            watch_range_start = start;
+            watch_range_end = stop;
+            out = dg_strdup_printf("Watchpoints apply to 0x%04x-0x%04x\n",
+                start, stop);
+        }
+    }
+    else if (0 == strcmp(cmd, "help")) {
+        out = dg_strdup(
+            "info -- show target signature, fuses, lock bits and calibration\n"
+            "watch-range [START END] -- only check watchpoints while the pc is\n"
+            "    in [START, END), or everywhere if no range is given\n");
+    }
+    else {
+        out = dg_strdup_printf("Unknown monitor command: %s\n", cmd);
+    }
+
+    write_console(fd, out);
+    write_response(fd, "OK");
+
+    free(out);
+    free(cmd);
+    return 0;
+}
+
+
+static bool breakpoint_hit(dg_debugwire_t *dw, bool *hit, dg_error_t **err);
+
+
+// waits for the mcu to halt, or for gdb to send something (usually ctrl-c).
+// halted tells which one, and may be NULL.
+static bool
+wait(dg_debugwire_t *dw, int fd, bool *halted, dg_error_t **err)
+{
+    if (dw == NULL || err == NULL || *err != NULL)
+        return false;
+
+    if (halted != NULL)
+        *halted = false;
+
+    while (true) {
+        fd_set fds;
+        FD_ZERO(&fds);
+
+        // gdb may have sent something along with the last packet
+        if (rx_start < rx_end)
+            return true;
+
+        // the break may have been read ahead together with the last echo
+        bool serial_ready = dg_serial_pending(dw->fd) > 0;
+
+        if (!serial_ready) {
+            int nfds = 0;
+            if (dw->fd >= 0) {
+                FD_SET(dw->fd, &fds);
+                nfds = dw->fd;
+            }
+            if (fd >= 0) {
+                FD_SET(fd, &fds);
+                if (fd > nfds)
+                    nfds = fd;
+            }
+
+            int rv = select(nfds + 1, &fds, NULL, NULL, NULL);
+            if (rv == -1) {
+                *err = dg_error_new_errno(DG_ERROR_GDBSERVER, errno, "Failed select");
+                return false;
+            }
+            if (rv == 0) {
+                *err = dg_error_new(DG_ERROR_GDBSERVER, "Failed select, no data");
+                return false;
+            }
+            serial_ready = FD_ISSET(dw->fd, &fds);
+        }
+
+        if (!serial_ready)
+            return true;
+
+        // hardware breakpoint, or a break instruction
+        uint8_t b = dg_serial_recv_break(dw->fd, DG_SERIAL_TIMEOUT_AUTO, err);
+        if (*err != NULL)
+            return false;
+
+        if (b != 0x55) {
+            *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
+                "Bad break received from MCU. Expected 0x55, got 0x%02x", b);
+            return false;
+        }
+
+        // breaks gdb deleted are still in flash, and don't stop the program
+        bool stale;
+        if (!dg_debugwire_check_stale_breakpoint(dw, &stale, err))
+            return false;
+        // breaks whose conditions are false don't stop the program either
+        if (!stale) {
+            bool hit;
+            if (!breakpoint_hit(dw, &hit, err))
+                return false;
+            if (hit) {
+                if (halted != NULL)
+                    *halted = true;
+                return true;
+            }
+        }
+
+        if (!dg_debugwire_continue(dw, err))
+            return false;
+    }
+}
+
+
+static bool
+client_pending(int fd)
+{
+    if (rx_start < rx_end)
+        return true;
+
+    if (fd < 0)
+        return false;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval tv = {0, 0};
+    return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+
+// steps until the pc leaves [start, end) (byte addresses) or a breakpoint is
+// hit, and only the final stop goes to gdb. straight lines run at full speed
+// up to the next branch, on the hardware breakpoint, unless gdb is using it.
+static bool
+range_step(dg_debugwire_t *dw, int fd, uint32_t start, uint32_t end,
+    bool *halted, dg_error_t **err)
+{
+    if (dw == NULL || halted == NULL || err == NULL || *err != NULL)
+        return false;
+
+    *halted = true;
+
+    uint16_t pc;
+    if (!dg_debugwire_read_pc(dw, &pc, err))
+        return false;
+
+    while (true) {
+        uint16_t branch = pc;
+        if (!dw->hw_breakpoint_set &&
+            !dg_debugwire_find_branch(dw, pc, end / 2, &branch, err))
+            return false;
+
+        if (branch == pc) {
+            if (!dg_debugwire_step(dw, err))
+                return false;
+        }
+        else {
+            dw->hw_breakpoint = branch;
+            dw->hw_breakpoint_set = true;
+
+            bool rv = dg_debugwire_continue(dw, err) && wait(dw, fd, halted, err);
+
+            dw->hw_breakpoint = 0;
+            dw->hw_breakpoint_set = false;
+
+            // interrupted by gdb, the mcu is still running
+            if (!rv || !*halted)
+                return rv;
+        }
+
+        if (!dg_debugwire_read_pc(dw, &pc, err))
+            return false;
+
+        if (((uint32_t) pc) * 2 < start || ((uint32_t) pc) * 2 >= end ||
+            client_pending(fd))
+            return true;
+
+        bool hit = false;
+        if (dg_debugwire_has_breakpoint(dw, pc) && !breakpoint_hit(dw, &hit, err))
+            return false;
+        if (hit)
+            return true;
+    }
+}
+
+
+static bool
+in_watch_range(uint16_t pc)
+{
+    uint32_t addr = ((uint32_t) pc) * 2;
+    return !watch_range_set || (addr >= watch_range_start && addr < watch_range_end);
+}
+
+
+static bool
+add_watchpoint(uint16_t address, uint16_t len)
+{
+    uint32_t first = address;
+    uint32_t last = ((uint32_t) address) + len;
+    for (size_t i = 0; i < watchpoints_len; i++) {
+        if (watchpoints[i].address < first)
+            first = watchpoints[i].address;
+        if (((uint32_t) watchpoints[i].address) + watchpoints[i].len > last)
+            last = watchpoints[i].address + watchpoints[i].len;
+    }
+    if (len == 0 || last - first > DG_GDBSERVER_WATCH_SPAN)
+        return false;
+
+    watchpoints = dg_realloc(watchpoints,
+        sizeof(watchpoint_t) * (watchpoints_len + 1));
+    watchpoints[watchpoints_len].address = address;
+    watchpoints[watchpoints_len].len = len;
+    watchpoints_len++;
+    return true;
+}
+
+
+static void
+remove_watchpoint(uint16_t address, uint16_t len)
+{
+    for (size_t i = 0; i < watchpoints_len; i++) {
+        if (watchpoints[i].address == address && watchpoints[i].len == len) {
+            watchpoints[i] = watchpoints[--watchpoints_len];
+            return;
+        }
+    }
+}
+
+
+static void
+free_watchpoints(void)
+{
+    free(watchpoints);
+    watchpoints = NULL;
+    watchpoints_len = 0;
+    watch_range_set = false;
+}
+
+
+// steps until a watched byte changes, a breakpoint is hit or gdb sends
+// something. changed is set to the gdb address of the watchpoint that
+// triggered, or 0. inside the range each step costs four exchanges with the
+// target: the step itself, then the pc, z and the watched span, as every read
+// must close its own exchange. outside of it, the step and the pc.
+static bool
+watch(dg_debugwire_t *dw, int fd, uint32_t *changed, bool *halted,
+    dg_error_t **err)
+{
+    if (dw == NULL || changed == NULL || halted == NULL || err == NULL ||
+        *err != NULL)
+        return false;
+
+    *changed = 0;
+    *halted = true;
+
+    // the span may end right at the top of the address space
+    uint16_t first = watchpoints[0].address;
+    uint32_t last = ((uint32_t) watchpoints[0].address) + watchpoints[0].len;
+    for (size_t i = 1; i < watchpoints_len; i++) {
+        if (watchpoints[i].address < first)
+            first = watchpoints[i].address;
+        if (((uint32_t) watchpoints[i].address) + watchpoints[i].len > last)
+            last = watchpoints[i].address + watchpoints[i].len;
+    }
+
+    uint8_t old[DG_GDBSERVER_WATCH_SPAN];
+    uint8_t cur[DG_GDBSERVER_WATCH_SPAN];
+    bool sampled = false;
+
+    while (true) {
+        uint16_t pc;
+        if (!dg_debugwire_read_pc(dw, &pc, err))
+            return false;
+
+        bool compare = in_watch_range(pc);
+
+        if (compare && !sampled) {
+            if (!dg_debugwire_read_sram(dw, first, old, last - first, err))
+                return false;
+            sampled = true;
+        }
+
+        if (!compare && !dw->hw_breakpoint_set) {
+            dw->hw_breakpoint = watch_range_start / 2;
+            dw->hw_breakpoint_set = true;
+
+            bool rv = dg_debugwire_continue(dw, err) && wait(dw, fd, halted, err);
+
+            dw->hw_breakpoint = 0;
+            dw->hw_breakpoint_set = false;
+
+            if (!rv || !*halted)
+                return rv;
+        }
+        else if (!dg_debugwire_step(dw, err)) {
+            return false;
+        }
+
+        if (compare) {
+            if (!dg_debugwire_read_sram(dw, first, cur, last - first, err))
+                return false;
+
+            for (size_t i = 0; i < watchpoints_len; i++) {
+                size_t off = watchpoints[i].address - first;
+                if (0 != memcmp(old + off, cur + off, watchpoints[i].len)) {
+                    *changed = 0x800000 + watchpoints[i].address;
+                    return true;
+                }
+            }
+            memcpy(old, cur, last - first);
+        }
+        else {
+            // whatever changed out of the range doesn't count
+            sampled = false;
+        }
+
+        if (!dg_debugwire_read_pc(dw, &pc, err))
+            return false;
+
+        bool hit = false;
+        if (dg_debugwire_has_breakpoint(dw, pc) && !breakpoint_hit(dw, &hit, err))
+            return false;
+        if (hit || client_pending(fd))
+            return true;
+    }
+}
+
+
+static bool
+halt(dg_debugwire_t *dw, dg_error_t **err)
+{
+    uint8_t b = dg_serial_send_break(dw->fd, err);
+    if (*err != NULL)
+        return false;
+
+    if (b != 0x55) {
+        *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
+            "Bad break response from MCU. Expected 0x55, got 0x%02x", b);
+        return false;
+    }
+
+    return true;
+}
+
+
+// the registers gdb needs to find the current frame go along with the stop,
+// so gdb doesn't have to ask for them with a 'g' after every halt. the
+// context read costs three exchanges, that a 'g' would cost anyway, and it
+// stays cached. watch is the gdb address of the watchpoint that triggered,
+// or 0.
+static int
+write_stop_reply(dg_debugwire_t *dw, int fd, uint8_t signal, uint32_t watch,
+    dg_error_t **err)
+{
+    if (!dg_debugwire_read_context(dw, err) || *err != NULL)
+        return 1;
+
+    // gdb wants a byte address
+    uint32_t pc = ((uint32_t) dw->context.pc) << 1;
+
+    dg_string_t *s = dg_string_new();
+    dg_string_append_printf(s, "T%02x", signal);
+    if (watch != 0)
+        dg_string_append_printf(s, "watch:%x;", watch);
+    dg_string_append_printf(s, "1c:%02x;1d:%02x;20:%02x;21:%02x%02x;",
+        dw->context.registers[28], dw->context.registers[29], dw->context.sreg,
+        dw->context.sp & 0xff, dw->context.sp >> 8);
+    dg_string_append_printf(s, "22:%02x%02x%02x%02x;", pc & 0xff,
+        (pc >> 8) & 0xff, (pc >> 16) & 0xff, pc >> 24);
+    write_response(fd, s->str);
+    dg_string_free(s, true);
+
+    return 0;
+}
+
+
+static int
+handle_continue(dg_debugwire_t *dw, int fd, dg_error_t **err)
+{
+    uint32_t changed = 0;
+    bool halted;
+
+    if (watchpoints_len > 0) {
+        if (!watch(dw, fd, &changed, &halted, err) || *err != NULL)
+            return 1;
+    }
+    else {
+        if (!dg_debugwire_continue(dw, err) || *err != NULL)
+            return 1;
+        if (!wait(dw, fd, &halted, err) || *err != NULL)
+            return 1;
+    }
+
+    // gdb interrupted the program, usually with ctrl-c. the 0x03 is still
+    // waiting to be read, and just breaks again
+    if (!halted) {
+        if (!halt(dw, err))
+            return 1;
+        return write_stop_reply(dw, fd, 2, 0, err);
+    }
+
+    return write_stop_reply(dw, fd, 5, changed, err);
+}
+
+
+// there's a single thread, and the first action is applied to it
+static int
+handle_vcont(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
+{
+    if (0 == strcmp(cmd, "vCont?")) {
+        write_response(fd, "vCont;c;C;s;S;r");
+        return 0;
+    }
+
+    if (cmd[5] != ';') {
+        write_response(fd, "");
+        return 0;
+    }
+
+    const char *action = cmd + 6;
+
+    switch (action[0]) {
+        case 'c':
+        case 'C':
+            return handle_continue(dw, fd, err);
+
+        case 's':
+        case 'S':
+            if (!dg_debugwire_step(dw, err) || *err != NULL)
+                return 1;
+            break;
+
+        case 'r':
+            {
+                char *end;
+                uint32_t start = strtoul(action + 1, &end, 16);
+                if (*end != ',') {
+                    write_response(fd, "E01");
+                    return 0;
+                }
+                uint32_t stop = strtoul(end + 1, NULL, 16);
+                bool halted;
+                if (!range_step(dw, fd, start, stop, &halted, err) || *err != NULL)
+                    return 1;
+                if (!halted) {
+                    if (!halt(dw, err))
+                        return 1;
+                    return write_stop_reply(dw, fd, 2, 0, err);
+                }
+            }
+            break;
+
+        default:
+            write_response(fd, "E01");
+            return 0;
+    }
+
+    return write_stop_reply(dw, fd, 5, 0, err);
+}
+
+
+static int
+handle_memory_map(dg_debugwire_t *dw, int fd, const char *args)
+{
+    char **pieces = dg_str_split(args, ',', 2);
+    if (2 != dg_strv_length(pieces)) {
+        write_response(fd, "E01");
+        dg_strv_free(pieces);
+        return 0;
+    }
+    size_t offset = strtoul(pieces[0], NULL, 16);
+    size_t length = strtoul(pieces[1], NULL, 16);
+    dg_strv_free(pieces);
+
+    char *map = dg_strdup_printf(
+        "<?xml version=\"1.0\"?>\n"
+        "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+        "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+        "<memory-map>\n"
+        "  <memory type=\"flash\" start=\"0x0\" length=\"0x%x\">\n"
+        "    <property name=\"blocksize\">0x%x</property>\n"
+        "  </memory>\n"
+        "  <memory type=\"ram\" start=\"0x800000\" length=\"0x10000\"/>\n"
+        "  <memory type=\"ram\" start=\"0x810000\" length=\"0x%x\"/>\n"
+        "</memory-map>\n",
+        dw->dev->flash_size, dw->dev->flash_page_size, dw->dev->eeprom_size);
+
+    size_t map_len = strlen(map);
+    if (offset > map_len)
+        offset = map_len;
+    if (length > map_len - offset)
+        length = map_len - offset;
+
+    dg_string_t *r = dg_string_new();
+    dg_string_append_c(r, offset + length < map_len ? 'm' : 'l');
+    dg_string_append_len(r, map + offset, length);
+    write_response(fd, r->str);
+    dg_string_free(r, true);
+    free(map);
+
+    return 0;
+}
+
+
+static int
+handle_flash(dg_debugwire_t *dw, int fd, const char *cmd, size_t len,
+    dg_error_t **err)
+{
+    if (0 == strcmp(cmd, "vFlashDone")) {
+        if (!dg_debugwire_commit_flash(dw, err) || *err != NULL)
+            return 1;
+        write_response(fd, "OK");
+        return 0;
+    }
+
+    if (0 == strncmp(cmd, "vFlashErase:", 12)) {
+        char **pieces = dg_str_split(cmd + 12, ',', 2);
+        if (2 != dg_strv_length(pieces)) {
+            *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
+                "Malformed flash erase request: %s", cmd);
+            dg_strv_free(pieces);
+            return 1;
+        }
+        uint32_t addr = strtoul(pieces[0], NULL, 16);
+        uint32_t length = strtoul(pieces[1], NULL, 16);
+        dg_strv_free(pieces);
+
+        if (addr > dw->dev->flash_size || length > dw->dev->flash_size - addr) {
+            write_response(fd, "E01");
+            return 0;
+        }
+
+        if (!dg_debugwire_erase_flash(dw, addr, length, err) || *err != NULL)
+            return 1;
+        write_response(fd, "OK");
+        return 0;
+    }
+
+    if (0 == strncmp(cmd, "vFlashWrite:", 12)) {
+        const char *data = memchr(cmd + 12, ':', len - 12);
+        if (data == NULL) {
+            *err = dg_error_new(DG_ERROR_GDBSERVER, "Malformed flash write request");
+            return 1;
+        }
+        uint32_t addr = strtoul(cmd + 12, NULL, 16);
+        data++;
+
+        // binary data, with '}' escaping the next byte
+        size_t data_len = len - (data - cmd);
+        uint8_t *buf = dg_malloc(data_len);
+        size_t buf_len = 0;
+        for (size_t i = 0; i < data_len; i++) {
+            if (data[i] == '}' && i + 1 < data_len)
+                buf[buf_len++] = data[++i] ^ 0x20;
+            else
+                buf[buf_len++] = data[i];
+        }
+
+        if (addr > dw->dev->flash_size || buf_len > dw->dev->flash_size - addr) {
+            write_response(fd, "E01");
+            free(buf);
+            return 0;
+        }
+
+        bool ok = dg_debugwire_queue_flash(dw, addr, buf, buf_len, err) && *err == NULL;
+        free(buf);
+        if (!ok)
+            return 1;
+        write_response(fd, "OK");
+        return 0;
+    }
+
+    write_response(fd, "");
+    return 0;
+}
+
+
+// avr-gdb maps sram at 0x800000 and eeprom at 0x810000
+typedef enum {
+    MEMORY_INVALID = 0,
+    MEMORY_FLASH,
+    MEMORY_SRAM,
+    MEMORY_EEPROM,
+} memory_space_t;
+
+
+static memory_space_t
+get_memory_space(dg_debugwire_t *dw, uint32_t addr, uint32_t count,
+    uint32_t *start)
+{
+    memory_space_t rv;
+    uint32_t limit;
+
+    if (addr < 0x800000) {
+        rv = MEMORY_FLASH;
+        *start = addr;
+        limit = dw->dev->flash_size;
+    }
+    else if (addr < 0x810000) {
+        rv = MEMORY_SRAM;
+        *start = addr - 0x800000;
+        limit = 0x10000;
+    }
+    else if (addr < 0x820000) {
+        rv = MEMORY_EEPROM;
+        *start = addr - 0x810000;
+        limit = dw->dev->eeprom_size;
     }
     else {
-        struct sockaddr_in *a = (struct sockaddr_in*) addr;
-        inet_ntop(af, &(a->sin_addr), host, INET6_ADDRSTRLEN);
+        return MEMORY_INVALID;
     }
-    return dg_strdup(host);
+
+    if (*start > limit || count > limit - *start)
+        return MEMORY_INVALID;
+
+    return rv;
 }
 
 
-static u_int16_t
-get_port(int af, const struct sockaddr *addr)
+// breakpoint conditions are agent expressions, evaluated right after the
+// break arrives. gdb sends every condition of a location with each Z0, and
+// the breakpoint is hit if any of them is true.
+
+typedef struct {
+    uint16_t address;  // in words
+    uint8_t *expr;
+    size_t expr_len;
+} condition_t;
+
+static condition_t *conditions = NULL;
+static size_t conditions_len = 0;
+
+
+static void
+clear_conditions(uint16_t address)
 {
-    in_port_t port = 0;
-    if (af == AF_INET6) {
-        struct sockaddr_in6 *a = (struct sockaddr_in6*) addr;
-        port = a->sin6_port;
-    }
-    else {
-        struct sockaddr_in *a = (struct sockaddr_in*) addr;
-        port = a->sin_port;
+    size_t j = 0;
+    for (size_t i = 0; i < conditions_len; i++) {
+        if (conditions[i].address == address) {
+            free(conditions[i].expr);
+            continue;
+        }
+        conditions[j++] = conditions[i];
     }
-    return ntohs(port);
+    conditions_len = j;
 }
 
 
 static void
-write_response(int fd, const char *resp)
+free_conditions(void)
 {
-    uint8_t c = 0;
-    for (size_t i = 0; resp[i] != 0; i++)
-        c += resp[i];
+    for (size_t i = 0; i < conditions_len; i++)
+        free(conditions[i].expr);
+    free(conditions);
+    conditions = NULL;
+    conditions_len = 0;
+}
 
-    dg_debug_printf("$> command: %s\n", resp);
 
-    char *r = dg_strdup_printf("$%s#%02x", resp, c);
-    size_t len = strlen(r);
+// conditions come after the kind, as ";X<len>,<hex bytecode>"
+static bool
+parse_conditions(uint16_t address, const char *cmd)
+{
+    clear_conditions(address);
+
+    const char *c = strchr(cmd, ';');
+    while (c != NULL) {
+        if (c[1] != 'X')
+            return false;
+
+        char *end;
+        size_t len = strtoul(c + 2, &end, 16);
+        if (*end != ',' || len == 0 || strlen(end + 1) < len * 2)
+            return false;
+
+        uint8_t *expr = dg_malloc(len);
+        if (!dg_hex_decode(end + 1, len, expr)) {
+            free(expr);
+            return false;
+        }
 
-    int n = 0;
-    while (n < len)
-        n += write(fd, r + n, len - n);
+        conditions = dg_realloc(conditions,
+            sizeof(condition_t) * (conditions_len + 1));
+        conditions[conditions_len].address = address;
+        conditions[conditions_len].expr = expr;
+        conditions[conditions_len].expr_len = len;
+        conditions_len++;
+
+        c = strchr(end + 1, ';');
+    }
 
-    free(r);
+    return true;
 }
 
 
 static bool
-wait(dg_debugwire_t *dw, int fd, dg_error_t **err)
+agent_read_register(void *data, uint16_t reg, uint64_t *value,
+    dg_error_t **err)
 {
-    if (dw == NULL || err == NULL || *err != NULL)
+    dg_debugwire_t *dw = data;
+
+    if (reg < 32) {
+        uint8_t v;
+        if (!dg_debugwire_read_sram(dw, reg, &v, 1, err))
+            return false;
+        *value = v;
+        return true;
+    }
+
+    if (reg > 34)
         return false;
 
-    fd_set fds;
-    FD_ZERO(&fds);
+    if (!dg_debugwire_read_context(dw, err))
+        return false;
 
-    int nfds = 0;
-    if (dw->fd >= 0) {
-        FD_SET(dw->fd, &fds);
-        nfds = dw->fd;
+    switch (reg) {
+        case 32:
+            *value = dw->context.sreg;
+            break;
+        case 33:
+            *value = dw->context.sp;
+            break;
+        case 34:
+            *value = ((uint32_t) dw->context.pc) << 1;
+            break;
     }
-    if (fd >= 0) {
-        FD_SET(fd, &fds);
-        if (fd > nfds)
-            nfds = fd;
+    return true;
+}
+
+
+static bool
+agent_read_memory(void *data, uint32_t address, uint8_t *values,
+    uint16_t values_len, dg_error_t **err)
+{
+    dg_debugwire_t *dw = data;
+
+    uint32_t start;
+    switch (get_memory_space(dw, address, values_len, &start)) {
+        case MEMORY_FLASH:
+            return dg_debugwire_read_flash(dw, start, values, values_len, err);
+        case MEMORY_SRAM:
+            return dg_debugwire_read_sram(dw, start, values, values_len, err);
+        case MEMORY_EEPROM:
+            return dg_debugwire_read_eeprom(dw, start, values, values_len, err);
+        default:
+            return false;
     }
+}
+
+
+static bool
+breakpoint_hit(dg_debugwire_t *dw, bool *hit, dg_error_t **err)
+{
+    *hit = true;
 
-    int rv = select(nfds + 1, &fds, NULL, NULL, NULL);
-    if (rv == -1) {
-        *err = dg_error_new_errno(DG_ERROR_GDBSERVER, errno, "Failed select");
+    uint16_t pc;
+    if (!dg_debugwire_read_pc(dw, &pc, err))
         return false;
+
+    if (dw->hw_breakpoint_set && dw->hw_breakpoint == pc)
+        return true;
+
+    const dg_agent_target_t target = {
+        .read_register = agent_read_register,
+        .read_memory = agent_read_memory,
+        .data = dw,
+    };
+
+    for (size_t i = 0; i < conditions_len; i++) {
+        if (conditions[i].address != pc)
+            continue;
+
+        // a condition that can't be evaluated stops, as gdb itself would
+        dg_error_t *tmp_err = NULL;
+        int64_t result;
+        if (!dg_agent_eval(conditions[i].expr, conditions[i].expr_len, &target,
+                &result, &tmp_err)) {
+            dg_debug_printf(" * Failed to evaluate condition: %s\n",
+                tmp_err != NULL ? tmp_err->msg : "unknown error");
+            dg_error_free(tmp_err);
+            return true;
+        }
+        if (result != 0)
+            return true;
+
+        *hit = false;
     }
-    if (rv == 0) {
-        *err = dg_error_new(DG_ERROR_GDBSERVER, "Failed select, no data");
-        return false;
+
+    return true;
+}
+
+
+// handles both M (hex) and X (binary) packets
+static int
+handle_memory_write(dg_debugwire_t *dw, int fd, const char *cmd, size_t len,
+    dg_error_t **err)
+{
+    const char *data = memchr(cmd, ':', len);
+    char *end;
+    uint32_t addr = strtoul(cmd + 1, &end, 16);
+    if (data == NULL || *end != ',') {
+        *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
+            "Malformed memory write request: %c", cmd[0]);
+        return 1;
+    }
+    uint32_t count = strtoul(end + 1, NULL, 16);
+    data++;
+
+    size_t data_len = len - (data - cmd);
+    uint8_t *buf = dg_malloc(data_len + 1);
+    size_t buf_len = 0;
+
+    if (cmd[0] == 'X') {
+        // binary data, with '}' escaping the next byte
+        for (size_t i = 0; i < data_len; i++) {
+            if (data[i] == '}' && i + 1 < data_len)
+                buf[buf_len++] = data[++i] ^ 0x20;
+            else
+                buf[buf_len++] = data[i];
+        }
+    }
+    else {
+        buf_len = data_len / 2;
+        if (!dg_hex_decode(data, buf_len, buf))
+            buf_len = 0;
     }
-    if (FD_ISSET(dw->fd, &fds) && dw->hw_breakpoint_set) {
-        uint8_t b = dg_serial_recv_break(dw->fd, err);
-        if (*err != NULL)
-            return false;
 
-        if (b != 0x55) {
-            *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
-                "Bad break received from MCU. Expected 0x55, got 0x%02x", b);
-            return false;
+    if (buf_len != count) {
+        write_response(fd, "E01");
+        free(buf);
+        return 0;
+    }
+
+    uint32_t start;
+    memory_space_t space = get_memory_space(dw, addr, count, &start);
+    if (space == MEMORY_INVALID) {
+        write_response(fd, "E01");
+        free(buf);
+        return 0;
+    }
+
+    // gdb probes X support with an empty write
+    bool ok = true;
+    if (count > 0) {
+        switch (space) {
+            case MEMORY_FLASH:
+                // only pages that actually change are programmed
+                ok = dg_debugwire_queue_flash(dw, start, buf, count, err) &&
+                    dg_debugwire_commit_flash(dw, err);
+                break;
+            case MEMORY_SRAM:
+                // written in chunks, and the register file goes to the context
+                ok = dg_debugwire_write_sram(dw, start, buf, count, err);
+                break;
+            case MEMORY_EEPROM:
+                // only bytes that actually change are written
+                ok = dg_debugwire_write_eeprom(dw, start, buf, count, err);
+                break;
+            default:
+                break;
         }
+        ok = ok && *err == NULL;
     }
+    free(buf);
+    if (!ok)
+        return 1;
 
-    return true;
+    write_response(fd, "OK");
+    return 0;
+}
+
+
+// gdb register numbers: r0-r31, sreg (32), sp (33) and pc (34)
+static void
+set_register(dg_debugwire_context_t *ctx, uint64_t *mask, size_t n,
+    const uint8_t *v)
+{
+    if (n < 32) {
+        ctx->registers[n] = v[0];
+        *mask |= ((uint64_t) 1) << n;
+        return;
+    }
+
+    switch (n) {
+        case 32:
+            ctx->sreg = v[0];
+            *mask |= ((uint64_t) 1) << DG_DEBUGWIRE_CONTEXT_SREG;
+            break;
+        case 33:
+            ctx->sp = v[0] | (v[1] << 8);
+            *mask |= ((uint64_t) 1) << DG_DEBUGWIRE_CONTEXT_SP;
+            break;
+        case 34:
+            // gdb sends a byte address
+            ctx->pc = (v[0] | (v[1] << 8) | (v[2] << 16)) >> 1;
+            *mask |= ((uint64_t) 1) << DG_DEBUGWIRE_CONTEXT_PC;
+            break;
+    }
 }
 
 
+static const size_t register_sizes[35] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 2, 4,
+};
+
+
 static int
-handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
+handle_command(dg_debugwire_t *dw, int fd, const char *cmd, size_t len,
+    dg_error_t **err)
 {
-    size_t len = strlen(cmd);
     if (len == 0) {
         *err = dg_error_new(DG_ERROR_GDBSERVER, "Empty command");
         return 1;
@@ -138,64 +1148,129 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
 
     switch (cmd[0]) {
         case 0x03:
-            {
-                uint8_t b = dg_serial_send_break(dw->fd, err);
-                if (*err != NULL)
-                    return 1;
-
-                if (b != 0x55) {
-                    *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
-                        "Bad break response from MCU. Expected 0x55, got 0x%02x", b);
-                    return 1;
-                }
-            }
-            return 0;
+            return halt(dw, err) ? 0 : 1;
 
         case 'q':
             if (0 == strcmp(cmd, "qAttached")) {
                 write_response(fd, "1");
                 return 0;
             }
+            if (0 == strncmp(cmd, "qRcmd,", 6))
+                return handle_monitor(dw, fd, cmd + 6, err);
+            if (0 == strncmp(cmd, "qSupported", 10)) {
+                char *r = dg_strdup_printf("PacketSize=%x;qXfer:memory-map:read+;"
+                    "ConditionalBreakpoints+;QStartNoAckMode+",
+                    DG_GDBSERVER_PACKET_SIZE);
+                write_response(fd, r);
+                free(r);
+                return 0;
+            }
+            if (0 == strncmp(cmd, "qXfer:memory-map:read::", 23))
+                return handle_memory_map(dw, fd, cmd + 23);
+            break;
+
+        case 'Q':
+            if (0 == strcmp(cmd, "QStartNoAckMode")) {
+                // gdb still acks this reply, the last ack in the session
+                write_response(fd, "OK");
+                no_ack = true;
+                return 0;
+            }
+            break;
+
+        case 'v':
+            if (0 == strncmp(cmd, "vFlash", 6))
+                return handle_flash(dw, fd, cmd, len, err);
+            if (0 == strncmp(cmd, "vCont", 5))
+                return handle_vcont(dw, fd, cmd, err);
             break;
 
         case 'g':
             {
-                uint8_t buf[39] = {0};
-
-                uint16_t pc = dg_debugwire_get_pc(dw, err);
-                if (*err != NULL)
+                // read once per halt, restored before the mcu runs again
+                if (!dg_debugwire_read_context(dw, err) || *err != NULL)
                     return 1;
 
+                uint8_t buf[39] = {0};
+                memcpy(buf, dw->context.registers, 32);
+                buf[32] = dw->context.sreg;
+                buf[33] = dw->context.sp;
+                buf[34] = dw->context.sp >> 8;
+
+                // gdb wants a byte address
+                uint32_t pc = ((uint32_t) dw->context.pc) << 1;
                 buf[35] = pc;
                 buf[36] = pc >> 8;
+                buf[37] = pc >> 16;
+                buf[38] = pc >> 24;
 
-                if (!dg_debugwire_read_registers(dw, 0, buf, 32, err) || *err != NULL)
-                    return 1;
+                uint8_t c;
+                write_response_start(&c);
+                write_response_append_hex(&c, buf, 39);
+                write_response_end(fd, c);
 
-                // sreg
-                if (!dg_debugwire_read_sram(dw, 0x5f, buf + 32, 1, err) || *err != NULL)
-                    return 1;
+                return 0;
+            }
+            break;
 
-                // spl sph
-                if (!dg_debugwire_read_sram(dw, 0x5d, buf + 33, 2, err) || *err != NULL)
-                    return 1;
+        case 'G':
+            {
+                uint8_t buf[39] = {0};
+                size_t buf_len = (len - 1) / 2;
+                if (buf_len > 39)
+                    buf_len = 39;
+                if (!dg_hex_decode(cmd + 1, buf_len, buf)) {
+                    write_response(fd, "E01");
+                    return 0;
+                }
 
-                if (!dg_debugwire_write_registers(dw, 28, buf + 28, 4, err) || *err != NULL)
-                    return 1;
+                dg_debugwire_context_t ctx;
+                uint64_t mask = 0;
+                size_t off = 0;
+                for (size_t i = 0; i < 35; i++) {
+                    if (off + register_sizes[i] > buf_len)
+                        break;
+                    set_register(&ctx, &mask, i, buf + off);
+                    off += register_sizes[i];
+                }
 
-                if (!dg_debugwire_set_pc(dw, pc, err) || *err != NULL)
+                // written back just before the mcu runs again
+                if (!dg_debugwire_write_context(dw, mask, &ctx, err) || *err != NULL)
                     return 1;
 
-                dg_string_t *s = dg_string_new();
-                for (size_t i = 0; i < 39; i++)
-                    dg_string_append_printf(s, "%02x", buf[i]);
-                write_response(fd, s->str);
-                dg_string_free(s, true);
+                write_response(fd, "OK");
+                return 0;
+            }
+            break;
+
+        case 'P':
+            {
+                char *end;
+                size_t n = strtoul(cmd + 1, &end, 16);
+                uint8_t v[4] = {0};
+                if (*end != '=' || n >= 35 ||
+                    strlen(end + 1) < register_sizes[n] * 2 ||
+                    !dg_hex_decode(end + 1, register_sizes[n], v)) {
+                    write_response(fd, "E01");
+                    return 0;
+                }
+
+                dg_debugwire_context_t ctx;
+                uint64_t mask = 0;
+                set_register(&ctx, &mask, n, v);
+
+                if (!dg_debugwire_write_context(dw, mask, &ctx, err) || *err != NULL)
+                    return 1;
 
+                write_response(fd, "OK");
                 return 0;
             }
             break;
 
+        case 'M':
+        case 'X':
+            return handle_memory_write(dw, fd, cmd, len, err);
+
         case 'm':
             {
                 char **pieces = dg_str_split(cmd + 1, ',', 2);
@@ -207,40 +1282,51 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
                 }
 
                 uint32_t addr = strtoul(pieces[0], NULL, 16);
-                uint16_t count = strtoul(pieces[1], NULL, 16);
+                uint32_t count = strtoul(pieces[1], NULL, 16);
                 dg_strv_free(pieces);
 
-                if (!dg_debugwire_cache_pc(dw, err) || *err != NULL)
-                    return 1;
-
-                if (!dg_debugwire_cache_yz(dw, err) || *err != NULL)
-                    return 1;
-
-                uint8_t buf[count];
-                if (addr < 0x800000) {
-                    if (!dg_debugwire_read_flash(dw, (uint16_t) addr, buf, count, err) || *err != NULL)
-                        return 1;
-                }
-                else if (addr < 0x810000) {
-                    if (!dg_debugwire_read_sram(dw, (uint16_t) addr, buf, count, err) || *err != NULL)
-                        return 1;
-                }
-                else {
+                uint32_t start;
+                memory_space_t space = get_memory_space(dw, addr, count, &start);
+                if (space == MEMORY_INVALID) {
                     write_response(fd, "E01");
-                    return 1;
+                    return 0;
                 }
 
-                if (!dg_debugwire_restore_yz(dw, err) || *err != NULL)
-                    return 1;
+                dg_debug_printf("$> command: (%u bytes of memory)\n", count);
+
+                // read in chunks, encoded into the reply as they arrive. the
+                // memory spaces are at most 64k, which bounds the reply
+                uint8_t buf[DG_GDBSERVER_READ_CHUNK];
+                uint8_t c;
+                write_response_start(&c);
+
+                for (uint32_t i = 0; i < count; i += DG_GDBSERVER_READ_CHUNK) {
+                    uint16_t len = count - i;
+                    if (len > DG_GDBSERVER_READ_CHUNK)
+                        len = DG_GDBSERVER_READ_CHUNK;
+
+                    // flash is cached, the target is only touched on a miss.
+                    // clobbered registers are restored before the mcu runs again
+                    switch (space) {
+                        case MEMORY_FLASH:
+                            dg_debugwire_read_flash(dw, start + i, buf, len, err);
+                            break;
+                        case MEMORY_SRAM:
+                            dg_debugwire_read_sram(dw, start + i, buf, len, err);
+                            break;
+                        case MEMORY_EEPROM:
+                            dg_debugwire_read_eeprom(dw, start + i, buf, len, err);
+                            break;
+                        default:
+                            break;
+                    }
+                    if (*err != NULL)
+                        return 1;
 
-                if (!dg_debugwire_restore_pc(dw, err) || *err != NULL)
-                    return 1;
+                    write_response_append_hex(&c, buf, len);
+                }
 
-                dg_string_t *s = dg_string_new();
-                for (size_t i = 0; i < count; i++)
-                    dg_string_append_printf(s, "%02x", buf[i]);
-                write_response(fd, s->str);
-                dg_string_free(s, true);
+                write_response_end(fd, c);
 
                 return 0;
             }
@@ -249,16 +1335,10 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
         case 's':
             if (!dg_debugwire_step(dw, err) || *err != NULL)
                 return 1;
-            write_response(fd, "S00");
-            return 0;
+            return write_stop_reply(dw, fd, 5, 0, err);
 
         case 'c':
-            if (!dg_debugwire_continue(dw, err) || *err != NULL)
-                return 1;
-            if (!wait(dw, fd, err) || *err != NULL)
-                return 1;
-            write_response(fd, "S00");
-            return 0;
+            return handle_continue(dw, fd, err);
 
         case 'Z':
             add = true;
@@ -273,6 +1353,34 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
                 }
 
                 switch (pieces[0][0]) {
+                    case '0':
+                        {
+                            uint32_t a = strtoul(pieces[1], NULL, 16);
+                            dg_strv_free(pieces);
+                            if (a + 2 > dw->dev->flash_size) {
+                                write_response(fd, "E01");
+                                return 0;
+                            }
+
+                            if (add && !parse_conditions(a / 2, cmd)) {
+                                clear_conditions(a / 2);
+                                write_response(fd, "E01");
+                                return 0;
+                            }
+
+                            // flash is only touched right before resuming
+                            if (add) {
+                                dg_debugwire_add_breakpoint(dw, a / 2, err);
+                            }
+                            else {
+                                clear_conditions(a / 2);
+                                dg_debugwire_remove_breakpoint(dw, a / 2, err);
+                            }
+                            if (*err != NULL)
+                                return 1;
+                        }
+                        write_response(fd, "OK");
+                        return 0;
                     case '1':
                         if (add) {
                             if (dw->hw_breakpoint_set) {
@@ -290,10 +1398,33 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
                         write_response(fd, "OK");
                         dg_strv_free(pieces);
                         return 0;
+                    case '2':
+                        {
+                            uint32_t start;
+                            uint32_t a = strtoul(pieces[1], NULL, 16);
+                            uint32_t l = strtoul(pieces[2], NULL, 16);
+                            dg_strv_free(pieces);
+                            if (MEMORY_SRAM != get_memory_space(dw, a, l, &start)) {
+                                write_response(fd, "E01");
+                                return 0;
+                            }
+
+                            if (!add) {
+                                remove_watchpoint(start, l);
+                            }
+                            else if (!add_watchpoint(start, l)) {
+                                write_response(fd, "E01");
+                                return 0;
+                            }
+                        }
+                        write_response(fd, "OK");
+                        return 0;
                     default:
-                        write_response(fd, "E01");
+                        // read and access watchpoints can't be told apart
+                        // from a value compare
+                        write_response(fd, "");
                         dg_strv_free(pieces);
-                        return 1;
+                        return 0;
                 }
 
                 dg_strv_free(pieces);
@@ -301,8 +1432,7 @@ handle_command(dg_debugwire_t *dw, int fd, const char *cmd, dg_error_t **err)
             break;
 
         case '?':
-            write_response(fd, "S00");
-            return 0;
+            return write_stop_reply(dw, fd, 5, 0, err);
     }
 
     write_response(fd, "");
@@ -319,6 +1449,42 @@ typedef enum {
 } command_state_t;
 
 
+static bool
+read_client(int fd, char *b, dg_error_t **err)
+{
+    if (rx_start == rx_end) {
+        ssize_t r;
+        do {
+            r = read(fd, rx, sizeof(rx));
+        } while (r < 0 && errno == EINTR);
+
+        if (r <= 0) {
+            *err = dg_error_new_errno(DG_ERROR_GDBSERVER, errno,
+                "Failed to read from client socket");
+            return false;
+        }
+
+        rx_start = 0;
+        rx_end = r;
+    }
+
+    *b = rx[rx_start++];
+    return true;
+}
+
+
+static bool
+write_ack(int fd, char ack, dg_error_t **err)
+{
+    dg_debug_printf("$> %s\n", ack == '+' ? "ack" : "nack");
+    if (1 != write(fd, &ack, 1)) {
+        *err = dg_error_new(DG_ERROR_GDBSERVER, "Failed to send ack to GDB");
+        return false;
+    }
+    return true;
+}
+
+
 static int
 handle_client(dg_debugwire_t *dw, int fd, dg_error_t **err)
 {
@@ -330,16 +1496,16 @@ handle_client(dg_debugwire_t *dw, int fd, dg_error_t **err)
     d[2] = 0;
 
     while (true) {
-        if (1 != read(fd, &b, 1)) {
-            *err = dg_error_new_errno(DG_ERROR_GDBSERVER, errno,
-                "Failed to read from client socket");
+        if (!read_client(fd, &b, err)) {
+            dg_string_free(cmd, true);
             return 1;
         }
 
-        if (b == 0x03) {
+        // binary packets may carry 0x03
+        if (b == 0x03 && s == COMMAND_ACK) {
             dg_debug_printf("$< ctrl-c\n");
             char cmd[2] = {0x03, 0};
-            int rv = handle_command(dw, fd, cmd, err);
+            int rv = handle_command(dw, fd, cmd, 1, err);
             if (rv != 0 || *err != NULL)
                 return rv;
             continue;
@@ -353,9 +1519,11 @@ handle_client(dg_debugwire_t *dw, int fd, dg_error_t **err)
                 }
                 if (b == '-') {
                     dg_debug_printf("$< nack\n");
-                    *err = dg_error_new(DG_ERROR_GDBSERVER,
-                        "GDB requested retransmission");  // FIXME: retransmit
-                    return 1;
+                    if (reply_len > 0) {
+                        dg_debug_printf("$> retransmission\n");
+                        write_all(fd, reply, reply_len);
+                    }
+                    break;
                 }
                 if (b == '$') {
                     s = COMMAND_START;
@@ -368,18 +1536,35 @@ handle_client(dg_debugwire_t *dw, int fd, dg_error_t **err)
             case COMMAND_START:
                 dg_string_free(cmd, true);
                 cmd = dg_string_new();
-                dg_string_append_c(cmd, b);
-                c = b;
+                c = 0;
                 s = COMMAND;
-                break;
+
+                // fall through
 
             case COMMAND:
                 if (b == '#') {
                     s = COMMAND_CHECKSUM1;
                     break;
                 }
-                dg_string_append_c(cmd, b);
-                c += b;
+
+                // the rest of the packet is usually buffered already
+                {
+                    const char *start = rx + rx_start - 1;
+                    const char *end = memchr(start, '#', rx + rx_end - start);
+                    size_t len = (end != NULL ? end : rx + rx_end) - start;
+
+                    if (cmd->len + len > DG_GDBSERVER_PACKET_SIZE) {
+                        *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
+                            "Packet too long, more than %d bytes", DG_GDBSERVER_PACKET_SIZE);
+                        dg_string_free(cmd, true);
+                        return 1;
+                    }
+
+                    for (size_t i = 0; i < len; i++)
+                        c += start[i];
+                    dg_string_append_len(cmd, start, len);
+                    rx_start += len - 1;
+                }
                 break;
 
             case COMMAND_CHECKSUM1:
@@ -392,24 +1577,34 @@ handle_client(dg_debugwire_t *dw, int fd, dg_error_t **err)
                 d[1] = b;
                 cd = strtoul(d, NULL, 16);
                 if (c != cd) {
+                    // gdb sends it again
+                    if (!no_ack) {
+                        dg_debug_printf("$< bad checksum, expected '%x', got '%x'\n",
+                            cd, c);
+                        if (!write_ack(fd, '-', err)) {
+                            dg_string_free(cmd, true);
+                            return 1;
+                        }
+                        break;
+                    }
                     *err = dg_error_new_printf(DG_ERROR_GDBSERVER,
                         "Bad checksum, expected '%x', got '%x'", cd, c);
+                    dg_string_free(cmd, true);
                     return 1;
                 }
                 dg_debug_printf("$< command: %s\n", cmd->str);
 
                 {
-                    dg_debug_printf("$> ack\n");
-                    c = '+';
-                    if (1 != write(fd, &c, 1)) {
-                        *err = dg_error_new(DG_ERROR_GDBSERVER,
-                            "Failed to send ack to GDB");
+                    if (!no_ack && !write_ack(fd, '+', err)) {
+                        dg_string_free(cmd, true);
                         return 1;
                     }
 
-                    int rv = handle_command(dw, fd, cmd->str, err);
-                    if (rv != 0 || *err != NULL)
+                    int rv = handle_command(dw, fd, cmd->str, cmd->len, err);
+                    if (rv != 0 || *err != NULL) {
+                        dg_string_free(cmd, true);
                         return rv;
+                    }
                 }
                 dg_string_free(cmd, true);
                 cmd = NULL;
@@ -540,6 +1735,24 @@ dg_gdbserver_run(dg_debugwire_t *dw, const char *host, const char *port,
     if (dg_debugwire_reset(dw, err) && *err == NULL)
         rv = handle_client(dw, client_socket, err);
 
+    free_conditions();
+    free_watchpoints();
+    no_ack = false;
+    rx_start = rx_end = 0;
+    free(reply);
+    reply = NULL;
+    reply_len = reply_size = 0;
+
+    // breaks stay in flash for the next session, if they can be recorded
+    dg_error_t *tmp_err = NULL;
+    if (!dg_debugwire_release_breakpoints(dw, &tmp_err) && tmp_err != NULL) {
+        if (*err == NULL)
+            *err = tmp_err;
+        else
+            dg_error_free(tmp_err);
+        rv = 1;
+    }
+
     close(client_socket);
     fprintf(stderr, " * Connection closed\n");
 
@@ -0,0 +1,79 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+
+// both digits of every byte, so encoding is a 2 byte copy per byte
+static const char pairs[513] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+// digit values plus one, zero for anything that is not a hex digit
+static const uint8_t values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+
+uint8_t
+dg_hex_checksum(const char *buf, size_t len, uint8_t checksum)
+{
+    for (size_t i = 0; i < len; i++)
+        checksum += buf[i];
+    return checksum;
+}
+
+
+size_t
+dg_hex_encode(const uint8_t *data, size_t len, char *out, uint8_t *checksum)
+{
+    uint8_t c = checksum != NULL ? *checksum : 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const char *p = pairs + data[i] * 2;
+        memcpy(out + i * 2, p, 2);
+        c += p[0] + p[1];
+    }
+
+    if (checksum != NULL)
+        *checksum = c;
+
+    return len * 2;
+}
+
+
+bool
+dg_hex_decode(const char *hex, size_t len, uint8_t *data)
+{
+    for (size_t i = 0; i < len; i++) {
+        uint8_t h = values[(uint8_t) hex[i * 2]];
+        uint8_t l = values[(uint8_t) hex[i * 2 + 1]];
+        if (h == 0 || l == 0)
+            return false;
+        data[i] = (h - 1) << 4 | (l - 1);
+    }
+    return true;
+}
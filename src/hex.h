@@ -0,0 +1,22 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// packet checksums are the sum of the packet bytes, modulo 256. the encoder
+// adds what it writes to checksum (if not NULL), so replies need no
+// separate pass. digits are lowercase, like gdb sends them.
+uint8_t dg_hex_checksum(const char *buf, size_t len, uint8_t checksum);
+size_t dg_hex_encode(const uint8_t *data, size_t len, char *out,
+    uint8_t *checksum);
+bool dg_hex_decode(const char *hex, size_t len, uint8_t *data);
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "debugwire.h"
 #include "error.h"
@@ -27,7 +28,7 @@ print_help(const char *host, const char *port)
 {
     printf(
         "usage:\n"
-        "    dwire-gdb [-h|-v|-i|-f|-z] [-d] [-m] [-s SERIAL_PORT] [-b BAUDRATE]\n"
+        "    dwire-gdb [-h|-v|-i|-f|-z] [-d] [-m] [-n] [-s SERIAL_PORT] [-b BAUDRATE]\n"
         "              [-t HOST] [-p PORT]\n"
         "              - A GDB server for AVR 8 bit microcontrollers, using\n"
         "                debugWire protocol through USB-to-TTL adapters.\n"
@@ -36,10 +37,13 @@ print_help(const char *host, const char *port)
         "    -h              show this help message and exit\n"
         "    -v              show version and exit\n"
         "    -i              detect target mcu signature and exit\n"
-        "    -f              detect target mcu fuses and exit\n"
-        "    -z              disable debugWire and exit\n"
+        "    -f              detect target mcu fuses and exit (with -i, also show\n"
+        "                    signature and oscillator calibration)\n"
+        "    -z              restore breakpoints left in flash, disable debugWire and\n"
+        "                    exit\n"
         "    -d              enable debug\n"
         "    -m              disable timers\n"
+        "    -n              ignore cached serial port, baud rate and target mcu\n"
         "    -s SERIAL_PORT  set serial port to connect to (e.g. /dev/ttyUSB0,\n"
         "                    default: detect)\n"
         "    -b BAUDRATE     set serial port baud rate (default: detect)\n"
@@ -52,7 +56,7 @@ print_help(const char *host, const char *port)
 static void
 print_usage(void)
 {
-    printf("usage: dwire-gdb [-h|-v|-i|-f|-z] [-d] [-m] [-s SERIAL_PORT] [-b BAUDRATE] "
+    printf("usage: dwire-gdb [-h|-v|-i|-f|-z] [-d] [-m] [-n] [-s SERIAL_PORT] [-b BAUDRATE] "
         "[-t HOST] [-p PORT]\n");
 }
 
@@ -68,6 +72,7 @@ main(int argc, char **argv)
     bool disable = false;
     bool debug = false;
     bool timer = true;
+    bool cache = true;
 
     char *serial_port = NULL;
     uint32_t baudrate = 0;
@@ -101,6 +106,9 @@ main(int argc, char **argv)
                 case 'm':
                     timer = false;
                     break;
+                case 'n':
+                    cache = false;
+                    break;
                 case 's':
                     if (argv[i][2] != '\0')
                         serial_port = dg_strdup(argv[i] + 2);
@@ -136,13 +144,21 @@ main(int argc, char **argv)
     }
 
     dg_debug_set(debug);
+    dg_cache_set(cache);
 
     dg_debugwire_t *dw = dg_debugwire_new(serial_port, baudrate, &err);
     if (dw == NULL || err != NULL)
         goto cleanup;
     dw->timer = timer;
 
-    if (identify) {
+    if (identify && fuses) {
+        // everything at once, in a single transfer
+        char *i = dg_debugwire_get_info_string(dw, &err);
+        if (i != NULL && err == NULL)
+            printf("%s", i);
+        free(i);
+    }
+    else if (identify) {
         printf("Target device: %s\n", dw->dev->name);
     }
     else if (fuses) {
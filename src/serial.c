@@ -11,12 +11,24 @@
 #include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#define DG_SERIAL_BUFFER_SIZE 4096
+
+// usb-to-ttl adapters hold received data for a while before sending it to
+// the host (e.g. 16ms for the default ftdi latency timer)
+#define DG_SERIAL_LATENCY 50
+
+// used when we don't know the baud rate of the port
+#define DG_SERIAL_TIMEOUT_FALLBACK 500
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stropts.h>
 #include <asm/termbits.h>
 #include <sys/ioctl.h>
@@ -27,20 +39,183 @@
 #include "utils.h"
 #include "serial.h"
 
+// frames queued for a port are written with a single write() call, and their
+// echoes are verified in a single pass when the queue is committed. everything
+// read from the port goes through a read-ahead buffer, refilled with large
+// reads, instead of a read() call per byte.
+typedef struct {
+    uint8_t *tx;
+    uint8_t *echo;
+    size_t tx_len;
+    size_t allocated_len;
+    uint8_t rx[DG_SERIAL_BUFFER_SIZE];
+    size_t rx_start;
+    size_t rx_end;
+    uint32_t baudrate;
+} dg_serial_port_t;
+
+static dg_serial_port_t **ports = NULL;
+static size_t ports_len = 0;
+
+
+static dg_serial_port_t*
+get_port(int fd, bool create)
+{
+    if (fd < 0)
+        return NULL;
+
+    if ((size_t) fd >= ports_len) {
+        if (!create)
+            return NULL;
+        ports = dg_realloc(ports, sizeof(dg_serial_port_t*) * (fd + 1));
+        for (size_t i = ports_len; i < (size_t) fd + 1; i++)
+            ports[i] = NULL;
+        ports_len = fd + 1;
+    }
 
-int
-dg_serial_open(const char *device, uint32_t baudrate, dg_error_t **err)
+    if (ports[fd] == NULL && create) {
+        ports[fd] = dg_malloc(sizeof(dg_serial_port_t));
+        ports[fd]->tx = NULL;
+        ports[fd]->echo = NULL;
+        ports[fd]->tx_len = 0;
+        ports[fd]->allocated_len = 0;
+        ports[fd]->rx_start = 0;
+        ports[fd]->rx_end = 0;
+        ports[fd]->baudrate = 0;
+    }
+
+    return ports[fd];
+}
+
+
+static void
+free_port(int fd)
 {
-    if (err == NULL || *err != NULL)
+    dg_serial_port_t *p = get_port(fd, false);
+    if (p == NULL)
+        return;
+
+    free(p->tx);
+    free(p->echo);
+    free(p);
+    ports[fd] = NULL;
+}
+
+
+static int64_t
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int64_t
+get_deadline(dg_serial_port_t *p, size_t len, int timeout)
+{
+    if (timeout == DG_SERIAL_TIMEOUT_INFINITE)
         return -1;
 
-    int fd = open(device, O_RDWR);
-    if (fd < 0) {
+    if (timeout == DG_SERIAL_TIMEOUT_AUTO) {
+        if (p->baudrate == 0) {
+            timeout = DG_SERIAL_TIMEOUT_FALLBACK;
+        }
+        else {
+            // 10 bits per byte (start + 8 data + stop)
+            timeout = DG_SERIAL_LATENCY + ((len * 10 * 1000) + p->baudrate - 1) /
+                p->baudrate;
+        }
+    }
+
+    return now() + timeout;
+}
+
+
+static bool
+fill_buffer(int fd, dg_serial_port_t *p, int64_t deadline, dg_error_t **err)
+{
+    int timeout = -1;
+    if (deadline >= 0) {
+        int64_t n = now();
+        timeout = deadline > n ? deadline - n : 0;
+    }
+
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN,
+        .revents = 0,
+    };
+
+    // an interrupted poll() fails the operation, so that unbounded waits can
+    // still be stopped.
+    int rv = poll(&pfd, 1, timeout);
+    if (rv < 0) {
         *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
-            "Failed to open serial port (%s [%d])", device, baudrate);
-        return fd;
+            "Failed to wait for data from serial port");
+        return false;
+    }
+    if (rv == 0) {
+        *err = dg_error_new_printf(DG_ERROR_SERIAL_TIMEOUT,
+            "Timed out waiting for data from serial port");
+        return false;
+    }
+
+    int c = read(fd, p->rx, DG_SERIAL_BUFFER_SIZE);
+    if (c < 0) {
+        *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
+            "Failed to read from serial port");
+        return false;
+    }
+    if (c == 0) {
+        *err = dg_error_new_printf(DG_ERROR_SERIAL,
+            "Got unexpected EOF from serial port");
+        return false;
+    }
+    for (int i = 0; i < c; i++)
+        dg_debug_printf("<<< 0x%02x\n", p->rx[i]);
+
+    p->rx_start = 0;
+    p->rx_end = c;
+
+    return true;
+}
+
+
+static int
+read_raw(int fd, uint8_t *buf, size_t len, int timeout, dg_error_t **err)
+{
+    dg_serial_port_t *p = get_port(fd, true);
+    if (p == NULL) {
+        *err = dg_error_new_printf(DG_ERROR_SERIAL,
+            "Invalid serial port file descriptor: %d", fd);
+        return -1;
+    }
+
+    int64_t deadline = get_deadline(p, len, timeout);
+
+    size_t n = 0;
+
+    while (n < len) {
+        if (p->rx_start == p->rx_end && !fill_buffer(fd, p, deadline, err))
+            return -1;
+
+        size_t c = p->rx_end - p->rx_start;
+        if (c > len - n)
+            c = len - n;
+
+        memcpy(buf + n, p->rx + p->rx_start, c);
+        p->rx_start += c;
+        n += c;
     }
 
+    return n;
+}
+
+
+static int
+set_termios(int fd, uint32_t baudrate)
+{
     struct termios2 cfg = {
         .c_cflag = BOTHER | CS8 | CLOCAL,
         .c_iflag = IGNPAR,
@@ -49,10 +224,31 @@ dg_serial_open(const char *device, uint32_t baudrate, dg_error_t **err)
         .c_ispeed = baudrate,
         .c_ospeed = baudrate,
     };
+    // reads never block, deadlines are handled with poll()
     cfg.c_cc[VMIN] = 0;
-    cfg.c_cc[VTIME] = 5;
+    cfg.c_cc[VTIME] = 0;
+
+    return ioctl(fd, TCSETS2, &cfg);
+}
+
+
+int
+dg_serial_open(const char *device, uint32_t baudrate, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return -1;
+
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+        *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
+            "Failed to open serial port (%s [%d])", device, baudrate);
+        return fd;
+    }
 
-    int rv = ioctl(fd, TCSETS2, &cfg);
+    // file descriptors are reused, make sure that we start clean
+    free_port(fd);
+
+    int rv = set_termios(fd, baudrate);
     if (rv != 0) {
         *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
             "Failed to set termios2 properties (%s [%d])", device, baudrate);
@@ -73,6 +269,8 @@ dg_serial_open(const char *device, uint32_t baudrate, dg_error_t **err)
         return rv;
     }
 
+    get_port(fd, true)->baudrate = baudrate;
+
     return fd;
 }
 
@@ -83,26 +281,23 @@ dg_serial_read(int fd, uint8_t *buf, size_t len, dg_error_t **err)
     if (err == NULL || *err != NULL)
         return 0;
 
-    int n = 0;
+    // whatever the target is about to send us is a response to the frames
+    // still waiting in the queue.
+    if (0 > dg_serial_commit(fd, err))
+        return -1;
 
-    while (n < len) {
-        int c = read(fd, buf + n, len - n);
-        if (c < 0) {
-            *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
-                "Failed to read from serial port");
-            return c;
-        }
-        if (c == 0 && n != len) {
-            *err = dg_error_new_printf(DG_ERROR_SERIAL,
-                "Got unexpected EOF from serial port");
-            return -1;
-        }
-        for (size_t i = n; i < n + c; i++)
-            dg_debug_printf("<<< 0x%02x\n", buf[i]);
-        n += c;
-    }
+    return read_raw(fd, buf, len, DG_SERIAL_TIMEOUT_AUTO, err);
+}
 
-    return n;
+
+size_t
+dg_serial_pending(int fd)
+{
+    dg_serial_port_t *p = get_port(fd, false);
+    if (p == NULL)
+        return 0;
+
+    return p->rx_end - p->rx_start;
 }
 
 
@@ -142,10 +337,63 @@ dg_serial_write(int fd, const uint8_t *buf, size_t len, dg_error_t **err)
     if (err == NULL || *err != NULL)
         return 0;
 
+    dg_serial_port_t *p = get_port(fd, false);
+    size_t queued = p != NULL ? p->tx_len : 0;
+
+    if (!dg_serial_queue(fd, buf, len, err))
+        return -1;
+
+    int n = dg_serial_commit(fd, err);
+    if (n < 0)
+        return n;
+
+    return n - queued;
+}
+
+
+bool
+dg_serial_queue(int fd, const uint8_t *buf, size_t len, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return false;
+
+    dg_serial_port_t *p = get_port(fd, true);
+    if (p == NULL) {
+        *err = dg_error_new_printf(DG_ERROR_SERIAL,
+            "Invalid serial port file descriptor: %d", fd);
+        return false;
+    }
+
+    if (p->tx_len + len > p->allocated_len) {
+        p->allocated_len = p->tx_len + len;
+        p->tx = dg_realloc(p->tx, p->allocated_len);
+        p->echo = dg_realloc(p->echo, p->allocated_len);
+    }
+
+    for (size_t i = 0; i < len; i++)
+        p->tx[p->tx_len++] = buf[i];
+
+    return true;
+}
+
+
+int
+dg_serial_commit(int fd, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return 0;
+
+    dg_serial_port_t *p = get_port(fd, false);
+    if (p == NULL || p->tx_len == 0)
+        return 0;
+
+    size_t len = p->tx_len;
+    p->tx_len = 0;
+
     int n = 0;
 
     while (n < len) {
-        int c = write(fd, buf + n, len - n);
+        int c = write(fd, p->tx + n, len - n);
         if (c < 0) {
             *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
                 "Failed to wrote to serial port");
@@ -157,29 +405,23 @@ dg_serial_write(int fd, const uint8_t *buf, size_t len, dg_error_t **err)
             return -1;
         }
         for (size_t i = n; i < n + c; i++)
-            dg_debug_printf(">>> 0x%02x\n", buf[i]);
+            dg_debug_printf(">>> 0x%02x\n", p->tx[i]);
         n += c;
     }
 
-    uint8_t *b = dg_malloc(sizeof(uint8_t) * len);
-    int r = dg_serial_read(fd, b, len, err);
-    if (*err != NULL) {
-        free(b);
+    if ((int) len != read_raw(fd, p->echo, len, DG_SERIAL_TIMEOUT_AUTO, err) ||
+        *err != NULL)
         return -1;
-    }
 
     for (size_t i = 0; i < len; i++) {
-        if (buf[i] != b[i]) {
+        if (p->tx[i] != p->echo[i]) {
             *err = dg_error_new_printf(DG_ERROR_SERIAL,
                 "Got unexpected byte echoed back. Expected 0x%02x, got 0x%02x",
-                buf[i], b[i]);
-            free(b);
+                p->tx[i], p->echo[i]);
             return -1;
         }
     }
 
-    free(b);
-
     return n;
 }
 
@@ -194,12 +436,51 @@ dg_serial_write_byte(int fd, uint8_t b, dg_error_t **err)
 }
 
 
+bool
+dg_serial_set_baudrate(int fd, uint32_t baudrate, dg_error_t **err)
+{
+    if (err == NULL || *err != NULL)
+        return false;
+
+    if (0 != set_termios(fd, baudrate)) {
+        *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
+            "Failed to set serial port baud rate (%d)", baudrate);
+        return false;
+    }
+
+    // whatever is buffered was received with the old baud rate
+    if (0 != dg_serial_flush(fd, err))
+        return false;
+
+    get_port(fd, true)->baudrate = baudrate;
+
+    return true;
+}
+
+
+void
+dg_serial_close(int fd)
+{
+    free_port(fd);
+    close(fd);
+}
+
+
 int
 dg_serial_flush(int fd, dg_error_t **err)
 {
     if (err == NULL || *err != NULL)
         return 0;
 
+    // flushing drops any frames still waiting in the queue and any data
+    // already read ahead, like the kernel does with its own buffers.
+    dg_serial_port_t *p = get_port(fd, false);
+    if (p != NULL) {
+        p->tx_len = 0;
+        p->rx_start = 0;
+        p->rx_end = 0;
+    }
+
     int rv = ioctl(fd, TCFLSH, TCIOFLUSH);
     if (rv != 0) {
         *err = dg_error_new_errno_printf(DG_ERROR_SERIAL, errno,
@@ -242,23 +523,38 @@ dg_serial_send_break(int fd, dg_error_t **err)
         return false;
     }
 
-    return dg_serial_recv_break(fd, err);
+    return dg_serial_recv_break(fd, DG_SERIAL_TIMEOUT_AUTO, err);
 }
 
 
 uint8_t
-dg_serial_recv_break(int fd, dg_error_t **err)
+dg_serial_recv_break(int fd, int timeout, dg_error_t **err)
 {
     if (err == NULL || *err != NULL)
         return 0;
 
-    uint8_t b;
-    do {
-        b = dg_serial_read_byte(fd, err);
-        if (*err != NULL)
-            return false;
+    if (0 > dg_serial_commit(fd, err))
+        return 0;
+
+    dg_serial_port_t *p = get_port(fd, true);
+    if (p == NULL) {
+        *err = dg_error_new_printf(DG_ERROR_SERIAL,
+            "Invalid serial port file descriptor: %d", fd);
+        return 0;
     }
-    while (b == 0x00 || b == 0xff);
 
-    return b;
+    // the noise is a couple of bytes, at most
+    int64_t deadline = get_deadline(p, 4, timeout);
+
+    // skip the break noise directly in the read-ahead buffer
+    while (true) {
+        if (p->rx_start == p->rx_end && !fill_buffer(fd, p, deadline, err))
+            return 0;
+
+        while (p->rx_start < p->rx_end) {
+            uint8_t b = p->rx[p->rx_start++];
+            if (b != 0x00 && b != 0xff)
+                return b;
+        }
+    }
 }
@@ -14,12 +14,21 @@
 
 #include "error.h"
 
+// timeouts, in milliseconds
+#define DG_SERIAL_TIMEOUT_AUTO 0  // derived from baud rate and data length
+#define DG_SERIAL_TIMEOUT_INFINITE -1
+
 int dg_serial_open(const char *device, uint32_t baudrate, dg_error_t **err);
+bool dg_serial_set_baudrate(int fd, uint32_t baudrate, dg_error_t **err);
+void dg_serial_close(int fd);
 int dg_serial_read(int fd, uint8_t *buf, size_t len, dg_error_t **err);
+size_t dg_serial_pending(int fd);
 uint8_t dg_serial_read_byte(int fd, dg_error_t **err);
 uint16_t dg_serial_read_word(int fd, dg_error_t **err);
 int dg_serial_write(int fd, const uint8_t *buf, size_t len, dg_error_t **err);
 bool dg_serial_write_byte(int fd, uint8_t b, dg_error_t **err);
+bool dg_serial_queue(int fd, const uint8_t *buf, size_t len, dg_error_t **err);
+int dg_serial_commit(int fd, dg_error_t **err);
 int dg_serial_flush(int fd, dg_error_t **err);
 uint8_t dg_serial_send_break(int fd, dg_error_t **err);
-uint8_t dg_serial_recv_break(int fd, dg_error_t **err);
+uint8_t dg_serial_recv_break(int fd, int timeout, dg_error_t **err);
@@ -0,0 +1,250 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../src/agent.h"
+#include "../src/error.h"
+
+
+static bool
+read_register(void *data, uint16_t reg, uint64_t *value, dg_error_t **err)
+{
+    assert_int_equal(reg, mock_type(int));
+    *value = mock_type(int);
+    return true;
+}
+
+
+static bool
+read_memory(void *data, uint32_t address, uint8_t *values,
+    uint16_t values_len, dg_error_t **err)
+{
+    assert_int_equal(address, mock_type(int));
+    assert_int_equal(values_len, mock_type(int));
+    const uint8_t *v = mock_type(const uint8_t*);
+    for (uint16_t i = 0; i < values_len; i++)
+        values[i] = v[i];
+    return true;
+}
+
+
+static const dg_agent_target_t target = {
+    .read_register = read_register,
+    .read_memory = read_memory,
+    .data = NULL,
+};
+
+
+static int64_t
+eval(const uint8_t *expr, size_t expr_len)
+{
+    dg_error_t *err = NULL;
+    int64_t rv = 0;
+    assert_true(dg_agent_eval(expr, expr_len, &target, &rv, &err));
+    assert_null(err);
+    return rv;
+}
+
+
+static dg_error_t*
+eval_error(const uint8_t *expr, size_t expr_len)
+{
+    dg_error_t *err = NULL;
+    int64_t rv = 0;
+    assert_false(dg_agent_eval(expr, expr_len, &target, &rv, &err));
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_AGENT);
+    return err;
+}
+
+
+static void
+test_eval_const(void **state)
+{
+    const uint8_t a[] = {0x22, 0xfe, 0x27};
+    assert_int_equal(eval(a, sizeof(a)), 0xfe);
+    const uint8_t b[] = {0x23, 0x12, 0x34, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), 0x1234);
+    const uint8_t c[] = {0x24, 0x12, 0x34, 0x56, 0x78, 0x27};
+    assert_int_equal(eval(c, sizeof(c)), 0x12345678);
+    const uint8_t d[] = {0x25, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0x27};
+    assert_int_equal(eval(d, sizeof(d)), -2);
+}
+
+
+static void
+test_eval_arithmetic(void **state)
+{
+    // (7 - 3) * 5 + 1
+    const uint8_t a[] = {0x22, 7, 0x22, 3, 0x03, 0x22, 5, 0x04, 0x22, 1, 0x02,
+        0x27};
+    assert_int_equal(eval(a, sizeof(a)), 21);
+
+    // -7 / 2, -7 % 2, 7 / 2 unsigned
+    const uint8_t b[] = {0x22, 0xf9, 0x16, 8, 0x22, 2, 0x05, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), -3);
+    const uint8_t c[] = {0x22, 0xf9, 0x16, 8, 0x22, 2, 0x07, 0x27};
+    assert_int_equal(eval(c, sizeof(c)), -1);
+    const uint8_t d[] = {0x22, 7, 0x22, 2, 0x06, 0x27};
+    assert_int_equal(eval(d, sizeof(d)), 3);
+
+    // shifts
+    const uint8_t e[] = {0x22, 1, 0x22, 4, 0x09, 0x27};
+    assert_int_equal(eval(e, sizeof(e)), 16);
+    const uint8_t f[] = {0x22, 0x80, 0x16, 8, 0x22, 4, 0x0a, 0x27};
+    assert_int_equal(eval(f, sizeof(f)), -8);
+    const uint8_t g[] = {0x22, 0x80, 0x22, 4, 0x0b, 0x27};
+    assert_int_equal(eval(g, sizeof(g)), 8);
+}
+
+
+static void
+test_eval_logic(void **state)
+{
+    const uint8_t a[] = {0x22, 5, 0x22, 5, 0x13, 0x27};
+    assert_int_equal(eval(a, sizeof(a)), 1);
+    const uint8_t b[] = {0x22, 5, 0x22, 6, 0x13, 0x0e, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), 1);
+    const uint8_t c[] = {0x22, 0xff, 0x16, 8, 0x22, 1, 0x14, 0x27};
+    assert_int_equal(eval(c, sizeof(c)), 1);
+    const uint8_t d[] = {0x22, 0xff, 0x16, 8, 0x22, 1, 0x15, 0x27};
+    assert_int_equal(eval(d, sizeof(d)), 0);
+    const uint8_t e[] = {0x22, 0x0c, 0x22, 0x0a, 0x0f, 0x22, 0x01, 0x10,
+        0x22, 0xff, 0x11, 0x27};
+    assert_int_equal(eval(e, sizeof(e)), 0xf6);
+    const uint8_t f[] = {0x22, 0, 0x12, 0x2a, 16, 0x27};
+    assert_int_equal(eval(f, sizeof(f)), 0xffff);
+}
+
+
+static void
+test_eval_stack(void **state)
+{
+    // 1 2 swap - => 1
+    const uint8_t a[] = {0x22, 1, 0x22, 2, 0x2b, 0x03, 0x27};
+    assert_int_equal(eval(a, sizeof(a)), 1);
+    // 3 dup * => 9
+    const uint8_t b[] = {0x22, 3, 0x28, 0x04, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), 9);
+    // 4 5 pop => 4
+    const uint8_t c[] = {0x22, 4, 0x22, 5, 0x29, 0x27};
+    assert_int_equal(eval(c, sizeof(c)), 4);
+    // 1 2 3 pick 2 => 1
+    const uint8_t d[] = {0x22, 1, 0x22, 2, 0x22, 3, 0x32, 2, 0x27};
+    assert_int_equal(eval(d, sizeof(d)), 1);
+    // 1 2 3 rot => 3 1 2, then - - => 3 - (1 - 2) = 4
+    const uint8_t e[] = {0x22, 1, 0x22, 2, 0x22, 3, 0x33, 0x03, 0x03, 0x27};
+    assert_int_equal(eval(e, sizeof(e)), 4);
+}
+
+
+static void
+test_eval_goto(void **state)
+{
+    // if 0 then 10 else 20
+    const uint8_t a[] = {0x22, 0, 0x20, 0x00, 0x0a, 0x22, 20, 0x21, 0x00,
+        0x0c, 0x22, 10, 0x27};
+    assert_int_equal(eval(a, sizeof(a)), 20);
+    const uint8_t b[] = {0x22, 1, 0x20, 0x00, 0x0a, 0x22, 20, 0x21, 0x00,
+        0x0c, 0x22, 10, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), 10);
+}
+
+
+static void
+test_eval_target(void **state)
+{
+    // r24 == 0x42
+    will_return(read_register, 24);
+    will_return(read_register, 0x42);
+    const uint8_t a[] = {0x26, 0x00, 24, 0x22, 0x42, 0x13, 0x27};
+    assert_int_equal(eval(a, sizeof(a)), 1);
+
+    // *(int16_t*) 0x800100 < 0
+    const uint8_t v[] = {0x34, 0x92};
+    will_return(read_memory, 0x800100);
+    will_return(read_memory, 2);
+    will_return(read_memory, v);
+    const uint8_t b[] = {0x24, 0x00, 0x80, 0x01, 0x00, 0x18, 0x16, 16, 0x22, 0,
+        0x14, 0x27};
+    assert_int_equal(eval(b, sizeof(b)), 1);
+
+    // trace bytecodes keep the address around
+    will_return(read_memory, 0x800100);
+    will_return(read_memory, 1);
+    will_return(read_memory, v);
+    const uint8_t c[] = {0x24, 0x00, 0x80, 0x01, 0x00, 0x0d, 1, 0x17, 0x27};
+    assert_int_equal(eval(c, sizeof(c)), 0x34);
+}
+
+
+static void
+test_eval_error(void **state)
+{
+    const uint8_t a[] = {0x02, 0x27};
+    dg_error_t *err = eval_error(a, sizeof(a));
+    assert_string_equal(err->msg, "Stack underflow at offset 0");
+    dg_error_free(err);
+
+    const uint8_t b[] = {0x22, 1};
+    err = eval_error(b, sizeof(b));
+    assert_string_equal(err->msg, "Expression ended without an end bytecode");
+    dg_error_free(err);
+
+    const uint8_t c[] = {0x23, 1};
+    err = eval_error(c, sizeof(c));
+    assert_string_equal(err->msg, "Truncated bytecode 0x23 at offset 0");
+    dg_error_free(err);
+
+    const uint8_t d[] = {0x22, 1, 0x01, 0x27};
+    err = eval_error(d, sizeof(d));
+    assert_string_equal(err->msg, "Unsupported bytecode 0x01 at offset 2");
+    dg_error_free(err);
+
+    const uint8_t e[] = {0x22, 1, 0x22, 0, 0x05, 0x27};
+    err = eval_error(e, sizeof(e));
+    assert_string_equal(err->msg, "Division by zero at offset 4");
+    dg_error_free(err);
+
+    const uint8_t f[] = {0x21, 0x00, 0x00};
+    err = eval_error(f, sizeof(f));
+    assert_string_equal(err->msg, "Expression did not end after 10000 bytecodes");
+    dg_error_free(err);
+
+    const uint8_t g[] = {0x22, 1, 0x28, 0x21, 0x00, 0x02};
+    err = eval_error(g, sizeof(g));
+    assert_string_equal(err->msg, "Stack overflow at offset 2");
+    dg_error_free(err);
+}
+
+
+int
+main(void)
+{
+    const UnitTest tests[] = {
+        unit_test(test_eval_const),
+        unit_test(test_eval_arithmetic),
+        unit_test(test_eval_logic),
+        unit_test(test_eval_stack),
+        unit_test(test_eval_goto),
+        unit_test(test_eval_target),
+        unit_test(test_eval_error),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,208 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/utils.h"
+#include "../src/cache.h"
+
+
+static void
+setup(void **state)
+{
+    char *dir = dg_strdup("/tmp/check_cache_XXXXXX");
+    assert_non_null(mkdtemp(dir));
+    setenv("XDG_CACHE_HOME", dir, 1);
+    *state = dir;
+}
+
+
+static void
+teardown(void **state)
+{
+    char *dir = *state;
+    char *f = dg_strdup_printf("%s/%s/sessions", dir, PACKAGE_NAME);
+    unlink(f);
+    free(f);
+    f = dg_strdup_printf("%s/%s/breakpoints", dir, PACKAGE_NAME);
+    unlink(f);
+    free(f);
+    f = dg_strdup_printf("%s/%s", dir, PACKAGE_NAME);
+    rmdir(f);
+    free(f);
+    rmdir(dir);
+    free(dir);
+    unsetenv("XDG_CACHE_HOME");
+}
+
+
+static void
+test_lookup_empty(void **state)
+{
+    setup(state);
+    uint32_t b = 0;
+    uint16_t s = 0;
+    assert_false(dg_cache_lookup("/dev/serial/by-id/foo", &b, &s));
+    assert_int_equal(b, 0);
+    assert_int_equal(s, 0);
+    teardown(state);
+}
+
+
+static void
+test_store_lookup(void **state)
+{
+    setup(state);
+    uint32_t b = 0;
+    uint16_t s = 0;
+    assert_true(dg_cache_store("/dev/serial/by-id/foo", 62500, 0x930b));
+    assert_true(dg_cache_store("/dev/serial/by-id/bar", 7812, 0x930c));
+    assert_true(dg_cache_lookup("/dev/serial/by-id/foo", &b, &s));
+    assert_int_equal(b, 62500);
+    assert_int_equal(s, 0x930b);
+    assert_true(dg_cache_lookup("/dev/serial/by-id/bar", &b, &s));
+    assert_int_equal(b, 7812);
+    assert_int_equal(s, 0x930c);
+    assert_false(dg_cache_lookup("/dev/serial/by-id/baz", &b, &s));
+
+    // updating an entry replaces it
+    assert_true(dg_cache_store("/dev/serial/by-id/foo", 57600, 0x930c));
+    assert_true(dg_cache_lookup("/dev/serial/by-id/foo", &b, &s));
+    assert_int_equal(b, 57600);
+    assert_int_equal(s, 0x930c);
+
+    char *f = dg_strdup_printf("%s/%s/sessions", (char*) *state, PACKAGE_NAME);
+    FILE *fp = fopen(f, "r");
+    assert_non_null(fp);
+    char buf[256];
+    size_t l = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[l] = '\0';
+    fclose(fp);
+    free(f);
+    assert_string_equal(buf,
+        "/dev/serial/by-id/foo 57600 930c\n"
+        "/dev/serial/by-id/bar 7812 930c\n");
+    teardown(state);
+}
+
+
+static void
+test_disabled(void **state)
+{
+    setup(state);
+    uint32_t b = 0;
+    uint16_t s = 0;
+    assert_true(dg_cache_store("/dev/serial/by-id/foo", 62500, 0x930b));
+    dg_cache_set(false);
+    assert_false(dg_cache_lookup("/dev/serial/by-id/foo", &b, &s));
+    assert_false(dg_cache_store("/dev/serial/by-id/foo", 7812, 0x930b));
+    dg_cache_set(true);
+    assert_true(dg_cache_lookup("/dev/serial/by-id/foo", &b, &s));
+    assert_int_equal(b, 62500);
+    teardown(state);
+}
+
+
+static void
+test_lookup_port(void **state)
+{
+    setup(state);
+    char *ports[] = {"/dev/null", "/dev/zero"};
+    assert_null(dg_cache_lookup_port(ports, 2));
+    assert_true(dg_cache_store("/dev/zero", 62500, 0x930b));
+    assert_true(dg_cache_store("/dev/full", 62500, 0x930b));
+    char *p = dg_cache_lookup_port(ports, 2);
+    assert_string_equal(p, "/dev/zero");
+    free(p);
+    teardown(state);
+}
+
+
+static void
+test_get_port_id(void **state)
+{
+    char *id = dg_cache_get_port_id("/dev/../dev/null");
+    assert_string_equal(id, "/dev/null");
+    free(id);
+    id = dg_cache_get_port_id("/dev/bola-guda");
+    assert_string_equal(id, "/dev/bola-guda");
+    free(id);
+    assert_null(dg_cache_get_port_id(NULL));
+}
+
+
+static void
+test_breakpoints(void **state)
+{
+    setup(state);
+    size_t len = 1;
+    assert_null(dg_cache_lookup_breakpoints("/dev/serial/by-id/foo", 0x930b, &len));
+    assert_int_equal(len, 0);
+
+    dg_cache_breakpoint_t bps[2] = {{0x0010, 0x940e}, {0x0123, 0xcfff}};
+    assert_true(dg_cache_store_breakpoints("/dev/serial/by-id/foo", 0x930b, bps, 2));
+    assert_true(dg_cache_store_breakpoints("/dev/serial/by-id/bar", 0x930b, bps + 1, 1));
+
+    dg_cache_breakpoint_t *r = dg_cache_lookup_breakpoints("/dev/serial/by-id/foo",
+        0x930b, &len);
+    assert_non_null(r);
+    assert_int_equal(len, 2);
+    assert_int_equal(r[0].address, 0x0010);
+    assert_int_equal(r[0].original, 0x940e);
+    assert_int_equal(r[1].address, 0x0123);
+    assert_int_equal(r[1].original, 0xcfff);
+    free(r);
+
+    // another target on the same adapter
+    assert_null(dg_cache_lookup_breakpoints("/dev/serial/by-id/foo", 0x930c, &len));
+    assert_int_equal(len, 0);
+
+    assert_true(dg_cache_store_breakpoints("/dev/serial/by-id/foo", 0x930b, NULL, 0));
+    assert_null(dg_cache_lookup_breakpoints("/dev/serial/by-id/foo", 0x930b, &len));
+    assert_int_equal(len, 0);
+
+    r = dg_cache_lookup_breakpoints("/dev/serial/by-id/bar", 0x930b, &len);
+    assert_non_null(r);
+    assert_int_equal(len, 1);
+    assert_int_equal(r[0].address, 0x0123);
+    free(r);
+
+    dg_cache_set(false);
+    assert_false(dg_cache_store_breakpoints("/dev/serial/by-id/foo", 0x930b, bps, 2));
+    assert_null(dg_cache_lookup_breakpoints("/dev/serial/by-id/bar", 0x930b, &len));
+    dg_cache_set(true);
+    teardown(state);
+}
+
+
+int
+main(void)
+{
+    const UnitTest tests[] = {
+        unit_test(test_lookup_empty),
+        unit_test(test_store_lookup),
+        unit_test(test_disabled),
+        unit_test(test_lookup_port),
+        unit_test(test_get_port_id),
+        unit_test(test_breakpoints),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,543 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/debugwire.h"
+#include "sim.h"
+
+
+static const dg_debugwire_device_t dev = {
+    .name = "ATtiny85",
+    .signature = 0x930b,
+    .flash_size = SIM_FLASH_SIZE,
+    .flash_page_size = SIM_PAGE_SIZE,
+    .eeprom_size = SIM_EEPROM_SIZE,
+};
+static uint8_t flash_cache[SIM_FLASH_SIZE];
+static bool flash_cache_valid[SIM_FLASH_SIZE / SIM_PAGE_SIZE];
+static uint8_t flash_staging[SIM_FLASH_SIZE];
+static bool flash_staging_dirty[SIM_FLASH_SIZE / SIM_PAGE_SIZE];
+
+
+static void
+dw_init(dg_debugwire_t *dw)
+{
+    memset(dw, 0, sizeof(dg_debugwire_t));
+    dw->fd = SIM_FD;
+    dw->dev = &dev;
+    dw->flash_cache = flash_cache;
+    dw->flash_cache_valid = flash_cache_valid;
+    dw->flash_staging = flash_staging;
+    dw->flash_staging_dirty = flash_staging_dirty;
+    memset(flash_cache_valid, 0, sizeof(flash_cache_valid));
+    memset(flash_staging_dirty, 0, sizeof(flash_staging_dirty));
+    sim_reset();
+    sim.pc = 0x0123;
+}
+
+
+static void
+test_read_context(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    sim.sram[0x5d] = 0xfd;
+    sim.sram[0x5e] = 0x08;
+    sim.sram[0x5f] = 0x82;
+
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_read_context(&dw, &err));
+    assert_null(err);
+
+    assert_int_equal(dw.context.pc, 0x0123);
+    for (size_t i = 0; i < 32; i++)
+        assert_int_equal(dw.context.registers[i], 0xa0 + i);
+    assert_int_equal(dw.context.sp, 0x08fd);
+    assert_int_equal(dw.context.sreg, 0x82);
+    assert_int_equal(dw.context.valid, 0x7ffffffffULL);
+
+    // the pc and z were clobbered while reading, and are still pending
+    assert_int_equal(dw.context.dirty, 0x4c0000000ULL);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+
+    // everything is cached until the next halt
+    size_t writes = sim.writes;
+    assert_true(dg_debugwire_read_context(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.writes, writes);
+}
+
+
+static void
+test_read_sram(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+
+    // spans the register file and sram, right after a halt
+    uint8_t b[8];
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_read_sram(&dw, 28, b, 8, &err));
+    assert_null(err);
+
+    const uint8_t e[8] = {0xbc, 0xbd, 0xbe, 0xbf, 0x20, 0x21, 0x22, 0x23};
+    assert_memory_equal(b, e, 8);
+    assert_int_equal(dw.context.pc, 0x0123);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+test_read_sram_dirty_io(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+
+    // written by gdb, still only in the context
+    dg_debugwire_context_t ctx;
+    ctx.sp = 0x045f;
+    ctx.sreg = 0x02;
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_write_context(&dw,
+        (1ULL << DG_DEBUGWIRE_CONTEXT_SP) | (1ULL << DG_DEBUGWIRE_CONTEXT_SREG),
+        &ctx, &err));
+    assert_null(err);
+
+    uint8_t b[4];
+    assert_true(dg_debugwire_read_sram(&dw, 0x5c, b, 4, &err));
+    assert_null(err);
+
+    const uint8_t e[4] = {0x5c, 0x5f, 0x04, 0x02};
+    assert_memory_equal(b, e, 4);
+    assert_int_equal(sim.sram[0x5d], 0x5d);
+}
+
+
+static void
+test_read_flash_cache(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    for (size_t i = 0; i < 4 * SIM_PAGE_SIZE; i++)
+        sim.flash[i] = i;
+
+    uint8_t b[4 * SIM_PAGE_SIZE];
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_read_flash(&dw, SIM_PAGE_SIZE + 0x10, b, 0x10, &err));
+    assert_null(err);
+    for (size_t i = 0; i < 0x10; i++)
+        assert_int_equal(b[i], SIM_PAGE_SIZE + 0x10 + i);
+
+    // only the pages still missing are read from the target
+    memset(sim.flash, 0x5a, 4 * SIM_PAGE_SIZE);
+    assert_true(dg_debugwire_read_flash(&dw, 0, b, 4 * SIM_PAGE_SIZE, &err));
+    assert_null(err);
+    for (size_t i = 0; i < 4 * SIM_PAGE_SIZE; i++)
+        assert_int_equal(b[i], i / SIM_PAGE_SIZE == 1 ? i : 0x5a);
+
+    size_t writes = sim.writes;
+    assert_true(dg_debugwire_read_flash(&dw, 0, b, 4 * SIM_PAGE_SIZE, &err));
+    assert_null(err);
+    assert_int_equal(sim.writes, writes);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+test_commit_flash(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    for (size_t i = 0; i < 3 * SIM_PAGE_SIZE; i++)
+        sim.flash[i] = i;
+
+    // the first page is written with what it already holds
+    uint8_t b[SIM_PAGE_SIZE];
+    for (size_t i = 0; i < SIM_PAGE_SIZE; i++)
+        b[i] = i;
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_queue_flash(&dw, 0, b, SIM_PAGE_SIZE, &err));
+    assert_null(err);
+
+    // bits are set too, so the page must be erased first
+    const uint8_t c[4] = {0xff, 0x00, 0x5a, 0xa5};
+    assert_true(dg_debugwire_queue_flash(&dw, SIM_PAGE_SIZE + 0x3e, c, 4, &err));
+    assert_null(err);
+
+    assert_true(dg_debugwire_commit_flash(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 2);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+
+    uint8_t e[3 * SIM_PAGE_SIZE];
+    for (size_t i = 0; i < 3 * SIM_PAGE_SIZE; i++)
+        e[i] = i;
+    memcpy(e + SIM_PAGE_SIZE + 0x3e, c, 4);
+    assert_memory_equal(sim.flash, e, 3 * SIM_PAGE_SIZE);
+
+    // the cache follows, without reading the flash again
+    size_t writes = sim.writes;
+    uint8_t f[3 * SIM_PAGE_SIZE];
+    assert_true(dg_debugwire_read_flash(&dw, 0, f, 3 * SIM_PAGE_SIZE, &err));
+    assert_null(err);
+    assert_memory_equal(f, e, 3 * SIM_PAGE_SIZE);
+    assert_int_equal(sim.writes, writes);
+
+    // nothing is pending, nothing is written
+    assert_true(dg_debugwire_queue_flash(&dw, SIM_PAGE_SIZE + 0x3e, c, 4, &err));
+    assert_null(err);
+    assert_true(dg_debugwire_commit_flash(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 2);
+
+    // r0, r1 and r29-r31 were used, and go back before the mcu runs
+    assert_int_equal(dw.context.dirty & 0xe0000003ULL, 0xe0000003ULL);
+    assert_int_equal(dw.context.registers[0], 0xa0);
+    assert_int_equal(dw.context.registers[31], 0xbf);
+}
+
+
+static void
+test_resident_breakpoints(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    for (size_t i = 0; i < 3 * SIM_PAGE_SIZE; i++)
+        sim.flash[i] = i;
+
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x24, &err));
+    assert_true(dg_debugwire_sync_breakpoints(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 1);
+    assert_int_equal(sim.flash[0x48], 0x98);
+    assert_int_equal(sim.flash[0x49], 0x95);
+
+    // reads show the original instruction
+    uint8_t b[SIM_PAGE_SIZE];
+    assert_true(dg_debugwire_read_flash(&dw, SIM_PAGE_SIZE, b, SIM_PAGE_SIZE, &err));
+    assert_null(err);
+    for (size_t i = 0; i < SIM_PAGE_SIZE; i++)
+        assert_int_equal(b[i], SIM_PAGE_SIZE + i);
+
+    // gdb removes and inserts it again around each resume, the break stays
+    assert_true(dg_debugwire_remove_breakpoint(&dw, 0x24, &err));
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x24, &err));
+    assert_true(dg_debugwire_sync_breakpoints(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 1);
+
+    // deleted, it is still left resident while another page is written
+    assert_true(dg_debugwire_remove_breakpoint(&dw, 0x24, &err));
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x50, &err));
+    assert_true(dg_debugwire_sync_breakpoints(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 2);
+    assert_int_equal(sim.flash[0x48], 0x98);
+    assert_int_equal(sim.flash[0xa0], 0x98);
+    assert_int_equal(sim.flash[0xa1], 0x95);
+
+    // a write on its page restores the original, and keeps the new break
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x26, &err));
+    assert_true(dg_debugwire_sync_breakpoints(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 3);
+    assert_int_equal(sim.flash[0x48], 0x48);
+    assert_int_equal(sim.flash[0x49], 0x49);
+    assert_int_equal(sim.flash[0x4c], 0x98);
+    assert_int_equal(sim.flash[0x4d], 0x95);
+    assert_int_equal(dw.breakpoints_len, 2);
+
+    free(dw.breakpoints);
+}
+
+
+static void
+test_step_restores_context(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+
+    dg_debugwire_context_t ctx;
+    ctx.registers[5] = 0x55;
+    ctx.registers[30] = 0x12;
+    ctx.sp = 0x045f;
+    ctx.sreg = 0x02;
+    ctx.pc = 0x0200;
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_write_context(&dw, (1ULL << 5) | (1ULL << 30) |
+        (1ULL << DG_DEBUGWIRE_CONTEXT_SP) | (1ULL << DG_DEBUGWIRE_CONTEXT_SREG) |
+        (1ULL << DG_DEBUGWIRE_CONTEXT_PC), &ctx, &err));
+    assert_null(err);
+
+    // clobbers z and the pc on the target
+    uint8_t b[4];
+    assert_true(dg_debugwire_read_sram(&dw, 0x60, b, 4, &err));
+    assert_null(err);
+    assert_int_not_equal(sim.pc, 0x0200);
+    assert_int_equal(sim.registers[31], 0x00);
+
+    assert_true(dg_debugwire_step(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.resumes, 1);
+
+    // everything was written back before the step
+    for (size_t i = 0; i < 32; i++)
+        if (i != 5 && i != 30)
+            assert_int_equal(sim.registers[i], 0xa0 + i);
+    assert_int_equal(sim.registers[5], 0x55);
+    assert_int_equal(sim.registers[30], 0x12);
+    assert_int_equal(sim.sram[0x5d], 0x5f);
+    assert_int_equal(sim.sram[0x5e], 0x04);
+    assert_int_equal(sim.sram[0x5f], 0x02);
+    assert_int_equal(sim.pc, 0x0201);
+
+    assert_int_equal(dw.context.valid, 0);
+    assert_int_equal(dw.context.dirty, 0);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+test_continue_restores_context(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    sim.pc = 0x0200;
+
+    // programming the break clobbers r0, r1, r29-r31 and the pc
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x0200, &err));
+    assert_null(err);
+
+    assert_true(dg_debugwire_continue(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.page_writes, 1);
+    assert_int_equal(sim.resumes, 1);
+
+    // resumed from the original instruction, with the context intact
+    assert_int_equal(sim.control, 0x60);
+    assert_int_equal(sim.inst, 0x0000);
+    for (size_t i = 0; i < 32; i++)
+        assert_int_equal(sim.registers[i], 0xa0 + i);
+    assert_int_equal(sim.pc, 0x0200);
+
+    assert_int_equal(dw.context.dirty, 0);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+
+    free(dw.breakpoints);
+}
+
+
+static void
+test_read_eeprom(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    for (size_t i = 0; i < SIM_EEPROM_SIZE; i++)
+        sim.eeprom[i] = i ^ 0x5a;
+
+    // three chunks, and eearh changes halfway through the first one
+    uint8_t b[0x40];
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_read_eeprom(&dw, 0xf0, b, 0x40, &err));
+    assert_null(err);
+    for (size_t i = 0; i < 0x40; i++)
+        assert_int_equal(b[i], (uint8_t) ((0xf0 + i) ^ 0x5a));
+
+    // with the context loaded, each chunk is a single exchange
+    size_t writes = sim.writes;
+    assert_true(dg_debugwire_read_eeprom(&dw, 0x1c0, b, 0x40, &err));
+    assert_null(err);
+    assert_int_equal(sim.writes - writes, 3);
+    for (size_t i = 0; i < 0x40; i++)
+        assert_int_equal(b[i], (uint8_t) ((0x1c0 + i) ^ 0x5a));
+
+    // r0-r27 and r29-r31 were used, and go back before the mcu runs
+    for (size_t i = 0; i < 32; i++)
+        assert_int_equal(dw.context.registers[i], 0xa0 + i);
+    assert_int_equal(dw.context.dirty & 0xffffffffULL, 0xefffffffULL);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+test_write_eeprom(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+    sim.eeprom[0x101] = 0x22;
+    sim.eeprom[0x103] = 0x44;
+
+    // bytes already right are not written again
+    const uint8_t b[4] = {0x11, 0x22, 0x33, 0x44};
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_write_eeprom(&dw, 0x100, b, 4, &err));
+    assert_null(err);
+    assert_memory_equal(sim.eeprom + 0x100, b, 4);
+    assert_int_equal(sim.eeprom_writes, 2);
+    assert_int_equal(sim.eeprom[0xff], 0xff);
+    assert_int_equal(sim.eeprom[0x104], 0xff);
+
+    for (size_t i = 0; i < 32; i++)
+        assert_int_equal(dw.context.registers[i], 0xa0 + i);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+set_word(uint16_t address, uint16_t opcode)
+{
+    sim.flash[address * 2] = opcode;
+    sim.flash[address * 2 + 1] = opcode >> 8;
+}
+
+
+static void
+test_find_branch(void **state)
+{
+    const uint16_t branches[] = {
+        0xcfff,  // rjmp .-2
+        0xd000,  // rcall .+0
+        0xf009,  // breq .+2
+        0xf7f9,  // brne .-2
+        0xfc00,  // sbrc r0, 0
+        0xfe07,  // sbrs r0, 7
+        0x1001,  // cpse r0, r1
+        0x9900,  // sbic 0x00, 0
+        0x9b00,  // sbis 0x00, 0
+        0x940c,  // jmp
+        0x940e,  // call
+        0x9409,  // ijmp
+        0x9419,  // eijmp
+        0x9509,  // icall
+        0x9519,  // eicall
+        0x9508,  // ret
+        0x9518,  // reti
+        0x9588,  // sleep
+        0x9598,  // break
+        0x95e8,  // spm
+    };
+    const uint16_t others[] = {
+        0x0000,  // nop
+        0xe0f0,  // ldi r31, 0x00
+        0x0c01,  // add r0, r1
+        0x2c01,  // mov r0, r1
+        0xb800,  // out 0x00, r0
+        0xb000,  // in r0, 0x00
+        0x9701,  // sbiw r24, 1
+        0x920f,  // push r0
+        0x900f,  // pop r0
+        0x9004,  // lpm r0, z
+        0x9478,  // sei
+        0x95a8,  // wdr
+    };
+
+    dg_debugwire_t dw;
+    uint16_t branch;
+    dg_error_t *err = NULL;
+
+    for (size_t i = 0; i < sizeof(branches) / sizeof(branches[0]); i++) {
+        dw_init(&dw);
+        set_word(0x101, branches[i]);
+        assert_true(dg_debugwire_find_branch(&dw, 0x100, 0x110, &branch, &err));
+        assert_null(err);
+        assert_int_equal(branch, 0x101);
+    }
+
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        dw_init(&dw);
+        set_word(0x101, others[i]);
+        assert_true(dg_debugwire_find_branch(&dw, 0x100, 0x110, &branch, &err));
+        assert_null(err);
+        assert_int_equal(branch, 0x110);
+    }
+}
+
+
+static void
+test_find_branch_two_words(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+
+    // the addresses look like rjmp and brbs, and are skipped
+    set_word(0x100, 0x9000);  // lds r0, 0xc000
+    set_word(0x101, 0xc000);
+    set_word(0x102, 0x9200);  // sts 0xf000, r0
+    set_word(0x103, 0xf000);
+    set_word(0x104, 0x940e);  // call 0x0000
+    set_word(0x105, 0x0000);
+
+    uint16_t branch;
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_find_branch(&dw, 0x100, 0x110, &branch, &err));
+    assert_null(err);
+    assert_int_equal(branch, 0x104);
+
+    // nothing up to the end
+    assert_true(dg_debugwire_find_branch(&dw, 0x100, 0x104, &branch, &err));
+    assert_null(err);
+    assert_int_equal(branch, 0x104);
+}
+
+
+static void
+test_find_branch_breakpoint(void **state)
+{
+    dg_debugwire_t dw;
+    dw_init(&dw);
+
+    // a break replacing a nop is not a branch
+    dg_error_t *err = NULL;
+    assert_true(dg_debugwire_add_breakpoint(&dw, 0x102, &err));
+    assert_true(dg_debugwire_sync_breakpoints(&dw, &err));
+    assert_null(err);
+    assert_int_equal(sim.flash[0x204], 0x98);
+
+    uint16_t branch;
+    assert_true(dg_debugwire_find_branch(&dw, 0x100, 0x110, &branch, &err));
+    assert_null(err);
+    assert_int_equal(branch, 0x110);
+
+    free(dw.breakpoints);
+}
+
+
+int
+main(void)
+{
+    const UnitTest tests[] = {
+        unit_test(test_read_context),
+        unit_test(test_read_sram),
+        unit_test(test_read_sram_dirty_io),
+        unit_test(test_read_flash_cache),
+        unit_test(test_commit_flash),
+        unit_test(test_resident_breakpoints),
+        unit_test(test_step_restores_context),
+        unit_test(test_continue_restores_context),
+        unit_test(test_read_eeprom),
+        unit_test(test_write_eeprom),
+        unit_test(test_find_branch),
+        unit_test(test_find_branch_two_words),
+        unit_test(test_find_branch_breakpoint),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,358 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../src/debugwire.h"
+#include "../src/gdbserver.h"
+#include "sim.h"
+
+#define GDB_PORT 23841
+
+
+static const dg_debugwire_device_t dev = {
+    .name = "ATtiny85",
+    .signature = 0x930b,
+    .flash_size = 0x2000,
+    .flash_page_size = 0x40,
+    .eeprom_size = 0x200,
+};
+static bool flash_cache_valid[0x80];
+
+
+// connects to the server, sends each chunk of the script on its own, giving
+// the server time to answer in between, and writes everything received
+// until the server goes quiet to out.
+static void
+gdb_client(int out, const char *const *script)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        _exit(1);
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(GDB_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    // the server may not be listening yet
+    const struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000000};
+    int rv = -1;
+    for (size_t i = 0; i < 500 && rv != 0; i++) {
+        rv = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+        if (rv != 0)
+            nanosleep(&delay, NULL);
+    }
+    if (rv != 0)
+        _exit(1);
+
+    const struct timespec pause = {.tv_sec = 0, .tv_nsec = 50000000};
+    for (size_t i = 0; script[i] != NULL; i++) {
+        if (i > 0)
+            nanosleep(&pause, NULL);
+        if ((ssize_t) strlen(script[i]) != write(fd, script[i], strlen(script[i])))
+            _exit(1);
+    }
+
+    char buf[4096];
+    size_t len = 0;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (len < sizeof(buf) && poll(&pfd, 1, 300) > 0) {
+        ssize_t c = read(fd, buf + len, sizeof(buf) - len);
+        if (c <= 0)
+            break;
+        len += c;
+    }
+
+    if ((ssize_t) len != write(out, buf, len))
+        _exit(1);
+
+    close(fd);
+    _exit(0);
+}
+
+
+// runs a session against the scripted client, and returns what it got
+// back in buf.
+static void
+run_session(dg_debugwire_t *dw, const char *const *script, char *buf,
+    size_t size)
+{
+    memset(dw, 0, sizeof(dg_debugwire_t));
+    dw->fd = SIM_FD;
+    dw->dev = &dev;
+    dw->flash_cache_valid = flash_cache_valid;
+
+    int p[2];
+    assert_int_equal(pipe(p), 0);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        close(p[0]);
+        gdb_client(p[1], script);
+    }
+    close(p[1]);
+
+    // the session ends when gdb goes away
+    dg_error_t *err = NULL;
+    char port[6];
+    snprintf(port, sizeof(port), "%d", GDB_PORT);
+    assert_int_equal(dg_gdbserver_run(dw, "127.0.0.1", port, &err), 1);
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_GDBSERVER);
+    dg_error_free(err);
+
+    int status;
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    size_t len = 0;
+    ssize_t c;
+    while (len < size - 1 && (c = read(p[0], buf + len, size - 1 - len)) > 0)
+        len += c;
+    close(p[0]);
+    buf[len] = 0;
+}
+
+
+static void
+packet(char *buf, size_t size, const char *data)
+{
+    uint8_t c = 0;
+    for (size_t i = 0; i < strlen(data); i++)
+        c += data[i];
+    snprintf(buf, size, "$%s#%02x", data, c);
+}
+
+
+static void
+test_stop_reply(void **state)
+{
+    sim_reset();
+    sim.pc = 0x0123;
+    sim.sram[0x5d] = 0xfd;
+    sim.sram[0x5e] = 0x08;
+    sim.sram[0x5f] = 0x82;
+
+    const char *script[] = {"$?#3f", NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    // pc is a byte address, in little endian
+    char expected[256];
+    expected[0] = '+';
+    packet(expected + 1, sizeof(expected) - 1,
+        "T051c:bc;1d:bd;20:82;21:fd08;22:46020000;");
+    assert_string_equal(buf, expected);
+
+    // the context was read over the link, and nothing is left behind
+    assert_int_equal(dw.context.pc, 0x0123);
+    assert_int_equal(sim.rx_start, sim.rx_end);
+}
+
+
+static void
+test_split_packet(void **state)
+{
+    sim_reset();
+
+    char p[32];
+    packet(p, sizeof(p), "qAttached");
+    char tail[32];
+    strcpy(tail, p + 5);
+    p[5] = 0;
+    char sum[3] = {tail[strlen(tail) - 1], 0};
+    tail[strlen(tail) - 1] = 0;
+
+    // the header, the rest of the payload and the last checksum digit
+    // arrive in separate reads
+    const char *script[] = {p, tail, sum, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    assert_string_equal(buf, "+$1#31");
+}
+
+
+static void
+test_several_packets(void **state)
+{
+    sim_reset();
+
+    char p[64];
+    packet(p, sizeof(p), "qAttached");
+    packet(p + strlen(p), sizeof(p) - strlen(p), "qAttached");
+    const char *script[] = {p, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    assert_string_equal(buf, "+$1#31+$1#31");
+}
+
+
+static void
+test_retransmission(void **state)
+{
+    sim_reset();
+
+    char p[32];
+    packet(p, sizeof(p), "qAttached");
+    const char *script[] = {p, "-", "-", NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    assert_string_equal(buf, "+$1#31$1#31$1#31");
+}
+
+
+static void
+test_bad_checksum(void **state)
+{
+    sim_reset();
+
+    char p[32];
+    packet(p, sizeof(p), "qAttached");
+
+    // gdb sends it again after the nack
+    const char *script[] = {"$qAttached#00", p, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    assert_string_equal(buf, "-+$1#31");
+}
+
+
+static void
+test_qsupported(void **state)
+{
+    sim_reset();
+
+    char p[64];
+    packet(p, sizeof(p), "qSupported:multiprocess+;swbreak+;hwbreak+");
+    const char *script[] = {p, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    char expected[256];
+    expected[0] = '+';
+    packet(expected + 1, sizeof(expected) - 1,
+        "PacketSize=10000;qXfer:memory-map:read+;ConditionalBreakpoints+;"
+        "QStartNoAckMode+");
+    assert_string_equal(buf, expected);
+}
+
+
+static void
+test_memory_map(void **state)
+{
+    sim_reset();
+
+    char p[64];
+    packet(p, sizeof(p), "qXfer:memory-map:read::0,fff");
+    const char *script[] = {p, NULL};
+    dg_debugwire_t dw;
+    char buf[1024];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    // the whole map fits, so this is the last chunk
+    assert_int_equal(strncmp(buf, "+$l<?xml version=\"1.0\"?>\n", 25), 0);
+    assert_non_null(strstr(buf,
+        "  <memory type=\"flash\" start=\"0x0\" length=\"0x2000\">\n"
+        "    <property name=\"blocksize\">0x40</property>\n"
+        "  </memory>\n"));
+    assert_non_null(strstr(buf,
+        "  <memory type=\"ram\" start=\"0x800000\" length=\"0x10000\"/>\n"
+        "  <memory type=\"ram\" start=\"0x810000\" length=\"0x200\"/>\n"
+        "</memory-map>\n#"));
+}
+
+
+static void
+test_memory_map_chunk(void **state)
+{
+    sim_reset();
+
+    char p[64];
+    packet(p, sizeof(p), "qXfer:memory-map:read::2,5");
+    const char *script[] = {p, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    // more of the map follows
+    char expected[256];
+    expected[0] = '+';
+    packet(expected + 1, sizeof(expected) - 1, "mxml v");
+    assert_string_equal(buf, expected);
+}
+
+
+static void
+test_no_ack_mode(void **state)
+{
+    sim_reset();
+
+    char p[32];
+    packet(p, sizeof(p), "QStartNoAckMode");
+    char q[32];
+    packet(q, sizeof(q), "qAttached");
+
+    // gdb acks the OK, and nothing is acked after that, either way
+    const char *script[] = {p, "+", q, NULL};
+    dg_debugwire_t dw;
+    char buf[256];
+    run_session(&dw, script, buf, sizeof(buf));
+
+    assert_string_equal(buf, "+$OK#9a$1#31");
+}
+
+
+int
+main(void)
+{
+    const UnitTest tests[] = {
+        unit_test(test_stop_reply),
+        unit_test(test_split_packet),
+        unit_test(test_several_packets),
+        unit_test(test_retransmission),
+        unit_test(test_bad_checksum),
+        unit_test(test_qsupported),
+        unit_test(test_memory_map),
+        unit_test(test_memory_map_chunk),
+        unit_test(test_no_ack_mode),
+    };
+    return run_tests(tests);
+}
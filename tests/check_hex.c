@@ -0,0 +1,96 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../src/hex.h"
+
+
+static void
+test_hex_checksum(void **state)
+{
+    assert_int_equal(dg_hex_checksum("", 0, 0), 0);
+    assert_int_equal(dg_hex_checksum("OK", 2, 0), 0x9a);
+    assert_int_equal(dg_hex_checksum("qSupported", 10, 0), 0x37);
+    assert_int_equal(dg_hex_checksum("K", 1, 'O'), 0x9a);
+}
+
+
+static void
+test_hex_encode(void **state)
+{
+    char out[513];
+    uint8_t data[256];
+    for (size_t i = 0; i < 256; i++)
+        data[i] = i;
+
+    assert_int_equal(dg_hex_encode(data, 256, out, NULL), 512);
+    out[512] = '\0';
+    for (size_t i = 0; i < 256; i++) {
+        char h[3];
+        snprintf(h, sizeof(h), "%02x", (unsigned) i);
+        assert_memory_equal(out + i * 2, h, 2);
+    }
+
+    const uint8_t a[] = {0xde, 0xad, 0x00, 0x42};
+    memset(out, 0, sizeof(out));
+    uint8_t c = 0;
+    assert_int_equal(dg_hex_encode(a, 4, out, &c), 8);
+    assert_string_equal(out, "dead0042");
+    assert_int_equal(c, dg_hex_checksum("dead0042", 8, 0));
+
+    // the checksum carries over
+    c = 'O';
+    assert_int_equal(dg_hex_encode(a, 2, out, &c), 4);
+    assert_int_equal(c, dg_hex_checksum("Odead", 5, 0));
+
+    assert_int_equal(dg_hex_encode(a, 0, out, &c), 0);
+}
+
+
+static void
+test_hex_decode(void **state)
+{
+    uint8_t data[4] = {0};
+    assert_true(dg_hex_decode("dead0042", 4, data));
+    assert_int_equal(data[0], 0xde);
+    assert_int_equal(data[1], 0xad);
+    assert_int_equal(data[2], 0x00);
+    assert_int_equal(data[3], 0x42);
+    assert_true(dg_hex_decode("BEEF", 2, data));
+    assert_int_equal(data[0], 0xbe);
+    assert_int_equal(data[1], 0xef);
+    assert_true(dg_hex_decode("", 0, data));
+    assert_false(dg_hex_decode("0g", 1, data));
+    assert_false(dg_hex_decode("g0", 1, data));
+    assert_false(dg_hex_decode("12 4", 2, data));
+    assert_false(dg_hex_decode("1\xff", 1, data));
+}
+
+
+int
+main(void)
+{
+    const UnitTest tests[] = {
+        unit_test(test_hex_checksum),
+        unit_test(test_hex_encode),
+        unit_test(test_hex_decode),
+    };
+    return run_tests(tests);
+}
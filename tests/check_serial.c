@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include "../src/utils.h"
 #include "../src/serial.h"
@@ -81,6 +82,19 @@ __wrap_usleep(useconds_t usec)
 }
 
 
+int
+__wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    assert_int_equal(nfds, 1);
+    assert_int_equal(fds[0].fd, mock_type(int));
+    assert_int_equal(fds[0].events, POLLIN);
+    int rv = mock_type(int);
+    fds[0].revents = rv > 0 ? POLLIN : 0;
+    errno = 0;
+    return rv;
+}
+
+
 ssize_t
 __wrap_read(int fd, void *buf, size_t count)
 {
@@ -209,11 +223,51 @@ test_open4(void **state)
 }
 
 
+static void
+test_set_baudrate1(void **state)
+{
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TCSETS2);
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_ioctl, 62500);
+    will_return(__wrap_ioctl, -1);
+
+    dg_error_t *err = NULL;
+    assert_false(dg_serial_set_baudrate(44, 62500, &err));
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_SERIAL);
+    assert_string_equal(err->msg, "Failed to set serial port baud rate (62500): (unset)");
+    dg_error_free(err);
+}
+
+
+static void
+test_set_baudrate2(void **state)
+{
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TCSETS2);
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_ioctl, 62500);
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TCFLSH);
+    will_return(__wrap_ioctl, 1);
+    will_return(__wrap_ioctl, TCIOFLUSH);
+    will_return(__wrap_ioctl, 0);
+
+    dg_error_t *err = NULL;
+    assert_true(dg_serial_set_baudrate(44, 62500, &err));
+    assert_null(err);
+}
+
+
 static void
 test_read1(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 21);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, -1);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -231,8 +285,10 @@ test_read1(void **state)
 static void
 test_read2(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 21);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 0);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -250,17 +306,23 @@ test_read2(void **state)
 static void
 test_read3(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 21);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 10);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 11);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 10);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 1);
-    will_return(__wrap_read, 10);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
     dg_error_t *err = NULL;
@@ -273,11 +335,47 @@ test_read3(void **state)
 }
 
 
+static void
+test_read4(void **state)
+{
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 0);
+
+    dg_error_t *err = NULL;
+    uint8_t buf[21];
+    int n = dg_serial_read(44, buf, 21, &err);
+    assert_int_equal(n, -1);
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_SERIAL_TIMEOUT);
+    assert_string_equal(err->msg, "Timed out waiting for data from serial port");
+    dg_error_free(err);
+}
+
+
+static void
+test_read5(void **state)
+{
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, -1);
+
+    dg_error_t *err = NULL;
+    uint8_t buf[21];
+    int n = dg_serial_read(44, buf, 21, &err);
+    assert_int_equal(n, -1);
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_SERIAL);
+    assert_string_equal(err->msg, "Failed to wait for data from serial port: (unset)");
+    dg_error_free(err);
+}
+
+
 static void
 test_read_byte1(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, -1);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -294,8 +392,10 @@ test_read_byte1(void **state)
 static void
 test_read_byte2(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 0);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -312,8 +412,10 @@ test_read_byte2(void **state)
 static void
 test_read_byte3(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 1);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -327,8 +429,10 @@ test_read_byte3(void **state)
 static void
 test_read_word1(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 2);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, -1);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -345,8 +449,10 @@ test_read_word1(void **state)
 static void
 test_read_word2(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 2);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 0);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -363,8 +469,10 @@ test_read_word2(void **state)
 static void
 test_read_word3(void **state)
 {
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 2);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 2);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
@@ -426,9 +534,11 @@ test_write3(void **state)
     will_return(__wrap_write, 1);
     will_return(__wrap_write, 10);
     will_return(__wrap_write, "u");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 21);
-    will_return(__wrap_read, 30);
     will_return(__wrap_read, "abcdefghijklmnopqrstuvxyz");
 
     dg_error_t *err = NULL;
@@ -480,9 +590,11 @@ test_write_byte3(void **state)
     will_return(__wrap_write, 1);
     will_return(__wrap_write, 10);
     will_return(__wrap_write, "c");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 1);
-    will_return(__wrap_read, 10);
     will_return(__wrap_read, "cccccccccc");
 
     dg_error_t *err = NULL;
@@ -492,6 +604,115 @@ test_write_byte3(void **state)
 }
 
 
+static void
+test_queue_commit1(void **state)
+{
+    will_return(__wrap_write, 44);
+    will_return(__wrap_write, 7);
+    will_return(__wrap_write, 7);
+    will_return(__wrap_write, "abcdefg");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 7);
+    will_return(__wrap_read, "abcdefg");
+
+    dg_error_t *err = NULL;
+    assert_true(dg_serial_queue(44, (uint8_t*) "abc", 3, &err));
+    assert_null(err);
+    assert_true(dg_serial_queue(44, (uint8_t*) "defg", 4, &err));
+    assert_null(err);
+    int n = dg_serial_commit(44, &err);
+    assert_int_equal(n, 7);
+    assert_null(err);
+
+    // nothing left to commit
+    n = dg_serial_commit(44, &err);
+    assert_int_equal(n, 0);
+    assert_null(err);
+}
+
+
+static void
+test_queue_commit2(void **state)
+{
+    will_return(__wrap_write, 44);
+    will_return(__wrap_write, 5);
+    will_return(__wrap_write, 5);
+    will_return(__wrap_write, "abcde");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 5);
+    will_return(__wrap_read, "abxde");
+
+    dg_error_t *err = NULL;
+    assert_true(dg_serial_queue(44, (uint8_t*) "abcde", 5, &err));
+    assert_null(err);
+    int n = dg_serial_commit(44, &err);
+    assert_int_equal(n, -1);
+    assert_non_null(err);
+    assert_int_equal(err->type, DG_ERROR_SERIAL);
+    assert_string_equal(err->msg,
+        "Got unexpected byte echoed back. Expected 0x63, got 0x78");
+    dg_error_free(err);
+}
+
+
+static void
+test_queue_read(void **state)
+{
+    will_return(__wrap_write, 44);
+    will_return(__wrap_write, 3);
+    will_return(__wrap_write, 3);
+    will_return(__wrap_write, "abc");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 3);
+    will_return(__wrap_read, "abc");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 2);
+    will_return(__wrap_read, "xy");
+
+    dg_error_t *err = NULL;
+    assert_true(dg_serial_queue(44, (uint8_t*) "abc", 3, &err));
+    assert_null(err);
+    uint16_t w = dg_serial_read_word(44, &err);
+    assert_int_equal(w, ('x' << 8) | 'y');
+    assert_null(err);
+}
+
+
+static void
+test_queue_write(void **state)
+{
+    will_return(__wrap_write, 44);
+    will_return(__wrap_write, 5);
+    will_return(__wrap_write, 5);
+    will_return(__wrap_write, "abcde");
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 5);
+    will_return(__wrap_read, "abcde");
+
+    dg_error_t *err = NULL;
+    assert_true(dg_serial_queue(44, (uint8_t*) "abc", 3, &err));
+    assert_null(err);
+    int n = dg_serial_write(44, (uint8_t*) "de", 2, &err);
+    assert_int_equal(n, 2);
+    assert_null(err);
+}
+
+
 static void
 test_send_break1(void **state)
 {
@@ -564,10 +785,40 @@ test_send_break3(void **state)
 
 static void
 test_send_break4(void **state)
+{
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TCFLSH);
+    will_return(__wrap_ioctl, 1);
+    will_return(__wrap_ioctl, TCIOFLUSH);
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TIOCSBRK);
+    will_return(__wrap_ioctl, -1);  // disable 3rd arg
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_usleep, 15000);
+    will_return(__wrap_ioctl, 44);
+    will_return(__wrap_ioctl, TIOCCBRK);
+    will_return(__wrap_ioctl, -1);  // disable 3rd arg
+    will_return(__wrap_ioctl, 0);
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 4);
+    will_return(__wrap_read, "\x00\x00\xff\x55");
+
+    dg_error_t *err = NULL;
+    uint8_t b = dg_serial_send_break(44, &err);
+    assert_int_equal(b, 0x55);
+    assert_null(err);
+}
+
+
+static void
+test_send_break5(void **state)
 {
     uint8_t z = 0x00;
     uint8_t f = 0xff;
-    uint8_t c = 0x55;
     will_return(__wrap_ioctl, 44);
     will_return(__wrap_ioctl, TCFLSH);
     will_return(__wrap_ioctl, 1);
@@ -582,27 +833,60 @@ test_send_break4(void **state)
     will_return(__wrap_ioctl, TIOCCBRK);
     will_return(__wrap_ioctl, -1);  // disable 3rd arg
     will_return(__wrap_ioctl, 0);
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 1);
     will_return(__wrap_read, &z);
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
-    will_return(__wrap_read, 1);
-    will_return(__wrap_read, &z);
-    will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
+    will_return(__wrap_read, 4096);
     will_return(__wrap_read, 1);
     will_return(__wrap_read, &f);
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
     will_return(__wrap_read, 44);
-    will_return(__wrap_read, 1);
-    will_return(__wrap_read, 1);
-    will_return(__wrap_read, &c);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 3);
+    will_return(__wrap_read, "\x55" "ab");
 
     dg_error_t *err = NULL;
     uint8_t b = dg_serial_send_break(44, &err);
     assert_int_equal(b, 0x55);
     assert_null(err);
+
+    // bytes read ahead are served from memory
+    uint16_t w = dg_serial_read_word(44, &err);
+    assert_int_equal(w, ('a' << 8) | 'b');
+    assert_null(err);
+}
+
+
+static void
+test_read_buffered(void **state)
+{
+    will_return(__wrap_poll, 44);
+    will_return(__wrap_poll, 1);
+    will_return(__wrap_read, 44);
+    will_return(__wrap_read, 4096);
+    will_return(__wrap_read, 5);
+    will_return(__wrap_read, "abcde");
+
+    dg_error_t *err = NULL;
+    uint8_t c = dg_serial_read_byte(44, &err);
+    assert_int_equal(c, 'a');
+    assert_null(err);
+    uint16_t w = dg_serial_read_word(44, &err);
+    assert_int_equal(w, ('b' << 8) | 'c');
+    assert_null(err);
+    uint8_t buf[3];
+    int n = dg_serial_read(44, buf, 2, &err);
+    assert_int_equal(n, 2);
+    assert_null(err);
+    buf[2] = 0;
+    assert_string_equal(buf, "de");
 }
 
 
@@ -614,9 +898,14 @@ main(void)
         unit_test(test_open2),
         unit_test(test_open3),
         unit_test(test_open4),
+        unit_test(test_set_baudrate1),
+        unit_test(test_set_baudrate2),
         unit_test(test_read1),
         unit_test(test_read2),
         unit_test(test_read3),
+        unit_test(test_read4),
+        unit_test(test_read5),
+        unit_test(test_read_buffered),
         unit_test(test_read_byte1),
         unit_test(test_read_byte2),
         unit_test(test_read_byte3),
@@ -629,10 +918,15 @@ main(void)
         unit_test(test_write_byte1),
         unit_test(test_write_byte2),
         unit_test(test_write_byte3),
+        unit_test(test_queue_commit1),
+        unit_test(test_queue_commit2),
+        unit_test(test_queue_read),
+        unit_test(test_queue_write),
         unit_test(test_send_break1),
         unit_test(test_send_break2),
         unit_test(test_send_break3),
         unit_test(test_send_break4),
+        unit_test(test_send_break5),
 
         // dg_serial_flush and dg_serial_recv_break are tested as side effect.
     };
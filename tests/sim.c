@@ -0,0 +1,336 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include "sim.h"
+
+sim_t sim;
+
+// any other file descriptor goes to the real calls
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_ioctl(int fd, unsigned long request, void *arg);
+
+
+void
+sim_reset(void)
+{
+    memset(&sim, 0, sizeof(sim));
+    for (size_t i = 0; i < 32; i++)
+        sim.registers[i] = 0xa0 + i;
+    for (size_t i = 0; i < 0x100; i++)
+        sim.sram[i] = i;
+    memset(sim.page_buffer, 0xff, SIM_PAGE_SIZE);
+    memset(sim.eeprom, 0xff, SIM_EEPROM_SIZE);
+
+    // nothing in progress
+    sim.sram[0x20 + 0x1c] = 0;  // EECR
+    sim.sram[0x20 + 0x37] = 0;  // SPMCSR
+}
+
+
+static void
+sim_reply(uint8_t b)
+{
+    assert_true(sim.rx_end < sizeof(sim.rx));
+    sim.rx[sim.rx_end++] = b;
+}
+
+
+static void
+sim_spm(void)
+{
+    uint16_t z = sim.registers[30] | (sim.registers[31] << 8);
+    uint16_t page = z & ~(SIM_PAGE_SIZE - 1);
+
+    assert_true(page < SIM_FLASH_SIZE);
+
+    switch (sim.sram[0x20 + 0x37]) {
+        case 1 << 0:  // fill the temporary page buffer
+            sim.page_buffer[z % SIM_PAGE_SIZE] = sim.registers[0];
+            sim.page_buffer[(z + 1) % SIM_PAGE_SIZE] = sim.registers[1];
+            break;
+        case 1 << 1 | 1 << 0:  // page erase
+            memset(sim.flash + page, 0xff, SIM_PAGE_SIZE);
+            break;
+        case 1 << 2 | 1 << 0:  // page write, can only clear bits
+            for (size_t i = 0; i < SIM_PAGE_SIZE; i++)
+                sim.flash[page + i] &= sim.page_buffer[i];
+            memset(sim.page_buffer, 0xff, SIM_PAGE_SIZE);
+            sim.page_writes++;
+            break;
+        default:
+            assert_true(!"unsupported spm");
+    }
+
+    sim.sram[0x20 + 0x37] = 0;
+}
+
+
+static void
+sim_out(uint8_t address, uint8_t value)
+{
+    uint8_t eecr = sim.sram[0x20 + 0x1c];
+    sim.sram[0x20 + address] = value;
+
+    if (address != 0x1c)
+        return;
+
+    uint16_t eear = sim.sram[0x20 + 0x1e] | (sim.sram[0x20 + 0x1f] << 8);
+    assert_true(eear < SIM_EEPROM_SIZE);
+
+    if (value & (1 << 0))  // EERE
+        sim.sram[0x20 + 0x1d] = sim.eeprom[eear];
+
+    if (value & (1 << 1)) {  // EEPE, only right after EEMPE
+        assert_true(eecr & (1 << 2));
+        sim.eeprom[eear] = sim.sram[0x20 + 0x1d];
+        sim.eeprom_writes++;
+    }
+
+    // reads and writes are done right away, only EEMPE stays set
+    sim.sram[0x20 + 0x1c] = value == (1 << 2) ? value : 0;
+}
+
+
+static void
+sim_exec(uint16_t op)
+{
+    uint8_t address = ((op >> 5) & 0x30) | (op & 0x0f);
+    uint8_t reg = (op >> 4) & 0x1f;
+
+    if (op == 0x0000)  // nop
+        return;
+    if ((op & 0xf000) == 0xe000)  // ldi
+        sim.registers[16 + (reg & 0x0f)] = ((op >> 4) & 0xf0) | (op & 0x0f);
+    else if ((op & 0xf800) == 0xb000)  // in
+        sim.registers[reg] = sim.sram[0x20 + address];
+    else if ((op & 0xf800) == 0xb800)  // out
+        sim_out(address, sim.registers[reg]);
+    else if (op == 0x95e8)
+        sim_spm();
+    else
+        assert_true(!"unsupported instruction");
+}
+
+
+static void
+sim_go(void)
+{
+    uint16_t z = sim.registers[30] | (sim.registers[31] << 8);
+
+    switch (sim.mode) {
+        case 0x00:  // sram read
+            for (uint16_t i = 0; i < sim.bp / 2; i++)
+                sim_reply(z + i < 32 ? sim.registers[z + i] : sim.sram[z + i]);
+            break;
+        case 0x02:  // flash read, through z
+            for (uint16_t i = 0; i < sim.bp / 2; i++) {
+                assert_true(z + i < SIM_FLASH_SIZE);
+                sim_reply(sim.flash[z + i]);
+            }
+            sim.registers[30] = z + sim.bp / 2;
+            sim.registers[31] = (z + sim.bp / 2) >> 8;
+            break;
+        case 0x01:  // register read
+            for (uint16_t i = sim.pc; i < sim.bp; i++)
+                sim_reply(sim.registers[i]);
+            break;
+        case 0x04:  // sram write
+            sim.data_len = (sim.bp - 1) / 2;
+            break;
+        case 0x05:  // register write
+            sim.data_len = sim.bp - sim.pc;
+            break;
+        default:
+            assert_true(!"unsupported frame mode");
+    }
+}
+
+
+static void
+sim_data(uint8_t b)
+{
+    uint16_t z = sim.registers[30] | (sim.registers[31] << 8);
+
+    if (sim.mode == 0x04) {
+        sim.sram[z] = b;
+        sim.registers[30] = z + 1;
+        sim.registers[31] = (z + 1) >> 8;
+    }
+    else {
+        sim.registers[sim.pc++] = b;
+    }
+    sim.data_len--;
+}
+
+
+static void
+sim_byte(uint8_t b)
+{
+    sim_reply(b);
+
+    if (sim.data_len > 0) {
+        sim_data(b);
+        return;
+    }
+
+    sim.cmd[sim.cmd_len++] = b;
+
+    switch (sim.cmd[0]) {
+        case 0x66:
+            break;
+        case 0x40:
+        case 0x41:
+        case 0x60:
+        case 0x61:
+        case 0x64:
+            sim.control = sim.cmd[0];
+            break;
+        case 0x23:
+            sim_exec(sim.inst);
+            break;
+        case 0x30:
+        case 0x32:
+            // runs until a break, nothing comes back for now
+            if (sim.cmd[0] == 0x32)
+                sim_exec(sim.inst);
+            sim.resumes++;
+            break;
+        case 0x31:
+        case 0x33:
+            // a single instruction, answered with a break. 0x64 runs the
+            // loaded one without touching the pc
+            if (sim.cmd[0] == 0x33)
+                sim_exec(sim.inst);
+            if (sim.control != 0x64) {
+                sim.pc++;
+                sim.resumes++;
+            }
+            sim_reply(0x00);
+            sim_reply(0x55);
+            break;
+        case 0x07:
+            // reset, answered with a break
+            sim_reply(0x00);
+            sim_reply(0x55);
+            break;
+        case 0x20:
+            sim_go();
+            break;
+        case 0xf0:
+            // one word ahead, as after a halt
+            sim_reply((sim.pc + 1) >> 8);
+            sim_reply(sim.pc + 1);
+            break;
+        case 0xc2:
+            if (sim.cmd_len < 2)
+                return;
+            sim.mode = sim.cmd[1];
+            break;
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+            if (sim.cmd_len < 3)
+                return;
+            if (sim.cmd[0] == 0xd0)
+                sim.pc = (sim.cmd[1] << 8) | sim.cmd[2];
+            else if (sim.cmd[0] == 0xd1)
+                sim.bp = (sim.cmd[1] << 8) | sim.cmd[2];
+            else
+                sim.inst = (sim.cmd[1] << 8) | sim.cmd[2];
+            break;
+        default:
+            assert_true(!"unsupported command");
+    }
+
+    sim.cmd_len = 0;
+}
+
+
+int
+__wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (nfds != 1 || fds[0].fd != SIM_FD)
+        return __real_poll(fds, nfds, timeout);
+
+    int rv = sim.rx_start < sim.rx_end ? 1 : 0;
+    fds[0].revents = rv > 0 ? POLLIN : 0;
+    errno = 0;
+    return rv;
+}
+
+
+ssize_t
+__wrap_read(int fd, void *buf, size_t count)
+{
+    if (fd != SIM_FD)
+        return __real_read(fd, buf, count);
+
+    size_t i;
+    for (i = 0; i < count && sim.rx_start < sim.rx_end; i++)
+        ((uint8_t*) buf)[i] = sim.rx[sim.rx_start++];
+    errno = 0;
+    return i;
+}
+
+
+ssize_t
+__wrap_write(int fd, const void *buf, size_t count)
+{
+    if (fd != SIM_FD)
+        return __real_write(fd, buf, count);
+
+    for (size_t i = 0; i < count; i++)
+        sim_byte(((const uint8_t*) buf)[i]);
+    sim.writes++;
+    errno = 0;
+    return count;
+}
+
+
+int
+__wrap_ioctl(int fd, unsigned long request, void *arg)
+{
+    if (fd != SIM_FD)
+        return __real_ioctl(fd, request, arg);
+
+    switch (request) {
+        case TCFLSH:
+            sim.rx_start = sim.rx_end = 0;
+            break;
+        case TIOCSBRK:
+            break;
+        case TIOCCBRK:
+            // the target answers a break with its own break
+            sim_reply(0x00);
+            sim_reply(0x55);
+            break;
+        default:
+            assert_true(!"unsupported ioctl");
+    }
+
+    errno = 0;
+    return 0;
+}
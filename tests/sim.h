@@ -0,0 +1,52 @@
+/*
+ * dwire-gdb: A GDB server for AVR 8 bit microcontrollers, using debugWire
+ *            protocol through USB-to-TTL adapters.
+ * Copyright (C) 2019 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the BSD License.
+ * See the file LICENSE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_FD 42
+#define SIM_FLASH_SIZE 0x2000
+#define SIM_PAGE_SIZE 0x40
+#define SIM_EEPROM_SIZE 0x200
+
+// a tiny debugwire target, behind the read(), write(), poll() and ioctl()
+// calls made for SIM_FD. every byte written is echoed back, and the
+// responses to the commands are appended to the echo stream as soon as the
+// command is complete, like a real target does. anything queued after a
+// command that gets a response collides with it. the i/o space is mapped
+// into the sram, and the instructions used by the debugger run against it.
+
+typedef struct {
+    uint8_t registers[32];
+    uint8_t sram[0x100];
+    uint8_t flash[SIM_FLASH_SIZE];
+    uint8_t page_buffer[SIM_PAGE_SIZE];
+    uint8_t eeprom[SIM_EEPROM_SIZE];
+    uint16_t pc;
+    uint16_t bp;
+    uint8_t mode;
+    uint8_t control;
+    uint16_t inst;
+    size_t page_writes;
+    size_t eeprom_writes;
+    size_t resumes;
+    uint8_t cmd[3];
+    size_t cmd_len;
+    size_t data_len;
+    size_t writes;
+    uint8_t rx[4096];
+    size_t rx_start;
+    size_t rx_end;
+} sim_t;
+
+extern sim_t sim;
+
+void sim_reset(void);